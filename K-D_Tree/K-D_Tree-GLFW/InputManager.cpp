@@ -1,4 +1,5 @@
 #include "InputManager.h"
+#include "Profiler.h"
 #include <iostream>
 
 double InputManager::_mousePos[2];
@@ -21,6 +22,7 @@ void InputManager::Init(GLFWwindow* window)
 
 void InputManager::Update()
 {
+	ProfileZone zone("InputManager::Update");
 	_prevLeftMouseButton = _leftMouseButton;
 	_leftMouseButton = glfwGetMouseButton(_window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
 	_prevDownKey = _downKey;
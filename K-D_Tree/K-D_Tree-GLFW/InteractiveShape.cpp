@@ -8,27 +8,20 @@ InteractiveShape::InteractiveShape(Collider collider, GLint vao, GLsizei count,
 	_mouseOver = false;
 	_selected = false;
 	_moved = false;
+	_handle = ShapeStore::AddShape(this, glm::vec2(collider.x, collider.y), glm::vec2(collider.width, collider.height) / 2.0f);
 }
 
-InteractiveShape::~InteractiveShape(){}
+InteractiveShape::~InteractiveShape()
+{
+	ShapeStore::RemoveShape(_handle);
+}
 
 void InteractiveShape::Update(float dt)
 {
+	// The shape store has already moved the shape and bounced it off the walls, so the transform just catches up with it
 	RenderShape::Update(dt);
-
-	// Constrain position to the screen
-	_transform.position.x = _transform.position.x > 1.337f ? 1.337f : _transform.position.x;
-	_transform.position.x = _transform.position.x < -1.337f ? -1.337f : _transform.position.x;
-	_transform.position.y = _transform.position.y > 1.0f ? 1.0f : _transform.position.y;
-	_transform.position.y = _transform.position.y < -1.0f ? -1.0f : _transform.position.y;
-	if (_transform.position.x == 1.337f || _transform.position.x == -1.337f)
-	{
-		_transform.linearVelocity.x *= -1.0f;
-	}
-	if (_transform.position.y == 1.0f || _transform.position.y == -1.0f)
-	{
-		_transform.linearVelocity.y *= -1.0f;
-	}
+	_transform.position.x = position().x;
+	_transform.position.y = position().y;
 
 	_mouseOut = false;
 	_moved = false;
@@ -36,12 +29,8 @@ void InteractiveShape::Update(float dt)
 	glm::vec2 mousePos = InputManager::GetMouseCoords();
 
 	//Check against the collider
-	float colTop = _transform.position.y + _collider.height / 2 + _collider.y;
-	float colBot = _transform.position.y - _collider.height / 2 + _collider.y;
-	float colRight = _transform.position.x + _collider.width / 2 + _collider.x;
-	float colLeft = _transform.position.x - _collider.width / 2 + _collider.x;
-
-	bool colliding = mousePos.x > colLeft && mousePos.x < colRight && mousePos.y > colBot && mousePos.y < colTop;
+	const ShapeBox& box = ShapeStore::boxes()[_handle];
+	bool colliding = mousePos.x > box.min.x && mousePos.x < box.max.x && mousePos.y > box.min.y && mousePos.y < box.max.y;
 	if (colliding)
 	{
 		if (!_selected)
@@ -60,8 +49,7 @@ void InteractiveShape::Update(float dt)
 		{
 			if (InputManager::leftMouseButton())
 			{
-				_transform.position.x = mousePos.x;
-				_transform.position.y = mousePos.y;
+				SetPosition(mousePos);
 			}
 			else
 			{
@@ -84,14 +72,41 @@ void InteractiveShape::Draw(const glm::mat4& viewProjMat)
 	RenderShape::Draw(viewProjMat);
 }
 
-const Collider& InteractiveShape::collider()
+// The collider in world space, centered where the shape store has it
+Collider InteractiveShape::collider()
 {
 	Collider ret = _collider;
-	ret.x += _transform.position.x;
-	ret.y += _transform.position.y;
+	ret.x = ShapeStore::x()[_handle];
+	ret.y = ShapeStore::y()[_handle];
 	return ret;
 }
 
 bool InteractiveShape::mouseOver() { return _mouseOver; }
 bool InteractiveShape::mouseOut() { return _mouseOut; }
+ShapeHandle InteractiveShape::handle() { return _handle; }
+
+glm::vec2 InteractiveShape::position()
+{
+	return glm::vec2(ShapeStore::x()[_handle] - _collider.x, ShapeStore::y()[_handle] - _collider.y);
+}
+
+void InteractiveShape::SetPosition(const glm::vec2& position)
+{
+	ShapeStore::x()[_handle] = position.x + _collider.x;
+	ShapeStore::y()[_handle] = position.y + _collider.y;
+	ShapeStore::UpdateBox(_handle);
+	_transform.position.x = position.x;
+	_transform.position.y = position.y;
+}
+
+glm::vec2 InteractiveShape::velocity()
+{
+	return glm::vec2(ShapeStore::velocityX()[_handle], ShapeStore::velocityY()[_handle]);
+}
+
+void InteractiveShape::SetVelocity(const glm::vec2& velocity)
+{
+	ShapeStore::velocityX()[_handle] = velocity.x;
+	ShapeStore::velocityY()[_handle] = velocity.y;
+}
 bool InteractiveShape::moved() { return _moved; }
\ No newline at end of file
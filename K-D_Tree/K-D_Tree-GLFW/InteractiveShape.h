@@ -1,5 +1,6 @@
 #pragma once
 #include "RenderShape.h"
+#include "ShapeStore.h"
 
 struct Collider
 {
@@ -27,9 +28,16 @@ public:
 
 	void Draw(const glm::mat4& viewProjMat);
 
-	const Collider& collider();
+	Collider collider();
 	bool mouseOver();
 	bool mouseOut();
+	ShapeHandle handle();
+
+	// The shape's position and velocity live in the shape store. Setting the position moves the shape's transform along with it.
+	glm::vec2 position();
+	void SetPosition(const glm::vec2& position);
+	glm::vec2 velocity();
+	void SetVelocity(const glm::vec2& velocity);
 	bool moved();
 
 private:
@@ -39,4 +47,5 @@ private:
 	bool _mouseOut;
 	bool _moved;
 	Collider _collider;
+	ShapeHandle _handle;
 };
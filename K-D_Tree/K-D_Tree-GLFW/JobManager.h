@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// A job that processes the items in [begin, end). The thread number is unique among the threads working on the same
+// batch and is always less than JobManager::numThreads(), so it can be used to pick per-thread scratch space.
+typedef std::function<void(int begin, int end, unsigned int thread)> RangeJob;
+
+// A job run on its own in the background while the calling thread gets on with something else
+typedef void (*Task)();
+
+class JobManager
+{
+public:
+
+	static void Init(int numWorkers = -1);
+
+	static void ParallelFor(int count, int chunkSize, const RangeJob& job);
+
+	static void StartTask(Task task);
+
+	static void WaitTask();
+
+	static bool taskPending();
+
+	static void DumpData();
+
+	static unsigned int numThreads();
+
+private:
+
+	static void WorkerLoop(unsigned int thread);
+
+	static void TaskLoop();
+
+	static void RunChunks(const RangeJob& job, int count, int chunkSize, unsigned int thread);
+
+	static bool StealChunks(unsigned int thread);
+
+	// The chunks still waiting to be run by one thread, as the range [begin, end) of chunk numbers. The owner takes chunks off the
+	// front and threads that have run out take half of what's left off the back.
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		int begin;
+		int end;
+	};
+
+	static std::vector<std::thread> _workers;
+	static std::mutex _mutex;
+	static std::condition_variable _wake;
+	static std::condition_variable _done;
+	static const RangeJob* _job;
+	static int _count;
+	static int _chunkSize;
+	// One queue for each thread, the calling thread's first
+	static std::vector<WorkQueue*> _queues;
+	static int _busyWorkers;
+	static unsigned int _generation;
+	static bool _quit;
+	// The thread that runs background tasks, and the task it's running or about to run. Pending stays set from when a task is
+	// started until it has been waited on.
+	static std::thread _taskThread;
+	static std::mutex _taskMutex;
+	static std::condition_variable _taskWake;
+	static std::condition_variable _taskDone;
+	static Task _task;
+	static bool _taskPending;
+};
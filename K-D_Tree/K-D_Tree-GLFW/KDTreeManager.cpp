@@ -2,25 +2,56 @@
 #include "InteractiveShape.h"
 #include "RenderShape.h"
 #include "RenderManager.h"
+#include "JobManager.h"
+#include "ShapeStore.h"
+#include "Profiler.h"
 
 #include <stack>
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
 
 std::vector<KDTreeNode*> KDTreeManager::_kdTree;
-std::vector<InteractiveShape*> KDTreeManager::_shapes;
+NodePool<KDTreeNode> KDTreeManager::_nodePool;
+std::vector<ShapeHandle> KDTreeManager::_shapes;
+std::vector<int> KDTreeManager::_slots;
+std::vector<KDTreeManager::NearestScratch> KDTreeManager::_nearestScratch;
+std::vector<std::pair<unsigned int, int>> KDTreeManager::_batchOrder;
+std::vector<KDTreeManager::DualNode> KDTreeManager::_dualNodes;
+std::vector<KDTreeManager::DualPair> KDTreeManager::_dualStack;
+std::vector<std::pair<float, ShapeHandle>> KDTreeManager::_allBest;
+std::vector<int> KDTreeManager::_allFound;
+bool KDTreeManager::_rebuilding = false;
+std::vector<ShapeHandle> KDTreeManager::_buildShapes;
+std::vector<int> KDTreeManager::_buildSlots;
+std::vector<KDTreeManager::BuiltNode> KDTreeManager::_buildNodes;
+std::vector<KDTreeManager::BuildTask> KDTreeManager::_buildStack;
+std::vector<KDTreeManager::BuildTask> KDTreeManager::_taskStack;
+std::vector<int> KDTreeManager::_deactivateStack;
+TreeStats KDTreeManager::_stats;
+std::vector<std::pair<ShapeHandle, bool>> KDTreeManager::_buildChanges;
+std::vector<bool> KDTreeManager::_buildChanged;
 int KDTreeManager::_maxDepth;
 int KDTreeManager::_maxMaxDepth;
 RenderShape KDTreeManager::_lineTemplate;
 
 // As with the octtreen and quadtree, the entire tree is instantiated when init is called. Unlike the previous trees, the 
-// entire tree will be used to sort the array of shapes. In the case of this particular demo however, the max depth of the
-// tree can be changed, so some of the nodes will be inactive if they are beyond the current max depth.
+// entire tree will be used to sort the array of shapes. The shapes are always sorted all the way down to the deepest level,
+// since a tree built that deep already contains every shallower tree. The max depth that can be changed in this demo only
+// limits how far down queries go and which division lines are shown. All of the nodes come out of a single block of the
+// node pool.
 void KDTreeManager::InitKDTree(int maxDepth, RenderShape lineTemplate)
 {
 
 	_maxDepth = maxDepth;
 	_maxMaxDepth = maxDepth;
 	_lineTemplate = lineTemplate;
-	_kdTree.resize(GetDepthIndex(_maxDepth));
+	_kdTree.resize(GetDepthIndex(_maxMaxDepth));
+	_nodePool.Init(_kdTree.size());
+	// A time-sliced rebuild has one entry for each node and walks the tree depth-first, so it never holds more than one task
+	// per level plus the one it's on
+	_buildNodes.reserve(_kdTree.size());
+	_buildStack.reserve(_maxMaxDepth + 2);
 
 	std::stack<KDTreeNode*> stack = std::stack<KDTreeNode*>();
 	stack.push(InitNode(0, -1, 0, 0, Root, X_Axis));
@@ -43,7 +74,7 @@ void KDTreeManager::InitKDTree(int maxDepth, RenderShape lineTemplate)
 				_kdTree[node->parent]->right = node->index;
 			}
 		}
-		if (node->depth != _maxDepth)
+		if (node->depth != _maxMaxDepth)
 		{
 			int mod = node->parent != -1 ? node->branchMod * 2 : 0;
 			int depthIndex = GetDepthIndex(node->depth);
@@ -55,152 +86,964 @@ void KDTreeManager::InitKDTree(int maxDepth, RenderShape lineTemplate)
 	}
 }
 
-void BubbleSort(std::vector<InteractiveShape*>& vector, int start, int end, Axis axis)
+// How many free slots a full rebuild reserves per shape so that inserts rarely have to look far for room
+static const float SLACK_RATIO = 0.25f;
+// Number of queries handed to a thread at a time by a batched nearest neighbor search
+static const int NEAREST_BATCH_CHUNK = 64;
+// A subtree is rebuilt once one of its sides holds more than this fraction of its shapes
+static const float BALANCE_ALPHA = 0.75f;
+// Subtrees with this many shapes or fewer are never rebuilt for balance
+static const int MIN_REBALANCE_SIZE = 8;
+
+// Where the center of the shape's collider is, read straight out of the shape store
+static glm::vec2 GetShapePosition(ShapeHandle handle)
+{
+	return glm::vec2(ShapeStore::x()[handle], ShapeStore::y()[handle]);
+}
+
+static float GetShapePosition(ShapeHandle handle, Axis axis)
+{
+	return axis == X_Axis ? ShapeStore::x()[handle] : ShapeStore::y()[handle];
+}
+
+// Records which slot a shape is in, making room in the slot array first if the shape's handle is past the end of it
+static void SetSlot(std::vector<int>& slots, ShapeHandle handle, int slot)
+{
+	if (handle >= slots.size()) slots.resize(handle + 1, -1);
+	slots[handle] = slot;
+}
+
+// The slot a shape is in, or -1 if it isn't in the tree
+static int GetSlot(const std::vector<int>& slots, ShapeHandle handle)
 {
-	bool sorted = false;
-	while (!sorted)
+	return handle < slots.size() ? slots[handle] : -1;
+}
+
+// Makes sure a vector can hold at least the given number of elements without growing. Capacity is doubled rather than grown a
+// little at a time, since this is called once for every shape that's added.
+template <typename T>
+static void ReserveAtLeast(std::vector<T>& vector, unsigned int size)
+{
+	if (vector.capacity() < size) vector.reserve(std::max(size, (unsigned int)vector.capacity() * 2));
+}
+
+// Orders shapes by their position along a single axis
+struct AxisLess
+{
+	Axis axis;
+
+	AxisLess(Axis sortAxis) : axis(sortAxis) {}
+
+	bool operator()(ShapeHandle a, ShapeHandle b) const
 	{
-		sorted = true;
-		int size = (int)vector.size();
-		for (int i = start; i < end && i < size - 1; ++i)
+		return GetShapePosition(a, axis) < GetShapePosition(b, axis);
+	}
+};
+
+// Puts the median of the live shapes packed at the front of [start, end] in place along the given axis and returns where it
+// ends up. Only the live shapes need ordering, and only far enough to put the median in place. A gap is then opened after the
+// left half so that each side keeps its share of the free slots.
+static int PartitionShapes(std::vector<ShapeHandle>& shapes, Axis axis, int start, int end, int live)
+{
+	int leftLive = (live - 1) / 2;
+	std::nth_element(shapes.begin() + start, shapes.begin() + start + leftLive, shapes.begin() + start + live, AxisLess(axis));
+
+	int freeSlots = end - start + 1 - live;
+	int leftFree = live > 1 ? (int)((long long)freeSlots * leftLive / (live - 1)) : freeSlots / 2;
+	int medianIndex = start + leftLive + leftFree;
+	if (leftFree > 0)
+	{
+		for (int i = start + live - 1; i >= start + leftLive; --i)
 		{
-			// Check whether the two current values are in lesser to greater order
-			if (axis == X_Axis && vector[i]->transform().position.x > vector[i + 1]->transform().position.x)
-			{
-				InteractiveShape* temp = vector[i + 1];
-				vector[i + 1] = vector[i];
-				vector[i] = temp;
-				sorted = false;
-			}
-			else if (axis == Y_Axis && vector[i]->transform().position.y > vector[i + 1]->transform().position.y)
-			{
-				InteractiveShape* temp = vector[i + 1];
-				vector[i + 1] = vector[i];
-				vector[i] = temp;
-				sorted = false;
-			}
+			shapes[i + leftFree] = shapes[i];
+		}
+		for (int i = start + leftLive; i < medianIndex; ++i)
+		{
+			shapes[i] = NO_SHAPE;
 		}
 	}
+	return medianIndex;
 }
 
 // For each node of the K-D tree, each node is deactivated and the shapes are sorted back into the tree.
-// Each node possesses a beginning and an ending index. The shapes in the array between these values are 
-// sorted based on the sorting axis of the current node of the tree. 
+// Any empty slots left behind by removed shapes are squeezed out first, and a fresh share of free slots
+// is reserved at the end of the array so that later insertions can be made without rebuilding the whole tree.
 void KDTreeManager::UpdateKDtree()
 {
+	ProfileZone zone("KDTreeManager::UpdateKDtree");
+	++_stats.rebuilds;
+	// A full rebuild supersedes any time-sliced one still under way
+	_rebuilding = false;
+	_buildStack.clear();
+	ClearBuildChanges();
+
 	unsigned int size = _kdTree.size();
 	for (unsigned int i = 0; i < size; ++i)
 	{
 		DeactivateNode(_kdTree[i]);
 	}
 
-	std::stack<int> startStack = std::stack<int>();
-	startStack.push(0);
-	std::stack<int> endStack = std::stack<int>();
-	endStack.push(_shapes.size() - 1);
-	std::stack<int> nodeStack = std::stack<int>();
-	nodeStack.push(0);
+	_shapes.erase(std::remove(_shapes.begin(), _shapes.end(), NO_SHAPE), _shapes.end());
+	int live = (int)_shapes.size();
+	_shapes.resize(live + (int)(live * SLACK_RATIO), NO_SHAPE);
+
+	BuildSubtree(0, 0, (int)_shapes.size() - 1, live);
+}
 
-	// To avoid messy recursion, node starting and ending values are stored in stacks.
+// Sorts the live shapes packed at the front of [start, end] into the subtree beginning at the given node.
+// Each node possesses a beginning and an ending index. The shapes in the array between these values are 
+// partitioned around the median of the current node's sorting axis, and the free slots in the range are
+// handed down to each side in proportion to the number of shapes on that side.
+void KDTreeManager::BuildSubtree(int nodeIndex, int start, int end, int live)
+{
+	_taskStack.clear();
+	BuildTask root = { nodeIndex, start, end, live };
+	_taskStack.push_back(root);
+
+	// To avoid messy recursion, node starting and ending values are stored in a stack.
 	// One level of the stack represents data for a single node. Since this system uses
-	// a stack and not a queue, the tree is build depth-first. 
-	while (!startStack.empty())
+	// a stack and not a queue, the tree is build depth-first. The stack is kept between
+	// builds so that it only allocates the first time it gets as deep as it does.
+	while (!_taskStack.empty())
+	{
+		BuildTask task = _taskStack.back();
+		_taskStack.pop_back();
+		start = task.start;
+		end = task.end;
+		live = task.live;
+		KDTreeNode* node = _kdTree[task.node];
+
+		node->start = start;
+		node->end = end;
+		node->live = live;
+
+		if (live == 0)
+		{
+			node->median = start;
+			DeactivateSubtree(node->index);
+			continue;
+		}
+
+		int leftLive = (live - 1) / 2;
+		int medianIndex = PartitionShapes(_shapes, node->axis, start, end, live);
+		node->median = medianIndex;
+
+		ActivateNode(node, GetShapePosition(_shapes[medianIndex], node->axis));
+
+		if (node->depth < _maxMaxDepth)
+		{
+			SetSlot(_slots, _shapes[medianIndex], medianIndex);
+
+			BuildTask left = { node->left, start, medianIndex - 1, leftLive };
+			_taskStack.push_back(left);
+			BuildTask right = { node->right, medianIndex + 1, end, live - 1 - leftLive };
+			_taskStack.push_back(right);
+		}
+		else
+		{
+			// The bottom of the tree keeps the rest of its shapes in one bucket on either side of the median
+			for (int i = start; i <= end; ++i)
+			{
+				if (_shapes[i] != NO_SHAPE) SetSlot(_slots, _shapes[i], i);
+			}
+		}
+	}
+}
+
+// Starts the same rebuild as UpdateKDtree, but one that's done a piece at a time by ContinueRebuild. The rebuild works on its
+// own copy of the shape array, so until it's finished the tree is left exactly as it was and keeps answering queries.
+void KDTreeManager::BeginRebuild()
+{
+	ProfileZone zone("KDTreeManager::BeginRebuild");
+	_buildShapes.clear();
+	unsigned int size = _shapes.size();
+	for (unsigned int i = 0; i < size; ++i)
 	{
-		int start = startStack.top();
-		startStack.pop();
-		int end = endStack.top();
-		endStack.pop();
-		int node = nodeStack.top();
-		nodeStack.pop();
+		if (_shapes[i] != NO_SHAPE) _buildShapes.push_back(_shapes[i]);
+	}
+	int live = (int)_buildShapes.size();
+	_buildShapes.resize(live + (int)(live * SLACK_RATIO), NO_SHAPE);
 
-		_kdTree[node]->start = start;
-		_kdTree[node]->end = end;
+	_buildSlots.assign(_slots.size(), -1);
+	BuiltNode empty = { 0, -1, 0, 0, false, 0.0f };
+	_buildNodes.assign(_kdTree.size(), empty);
+	_buildStack.clear();
+	BuildTask root = { 0, 0, (int)_buildShapes.size() - 1, live };
+	_buildStack.push_back(root);
+	ClearBuildChanges();
+	_rebuilding = true;
+}
 
-		BubbleSort(_shapes, start, end, _kdTree[node]->axis);
+// Sorts nodes of the rebuild started by BeginRebuild until the given number of microseconds have passed, and picks up where it
+// left off on the next call. This is the same depth-first walk as BuildSubtree, except that its stack is kept between calls and
+// what it finds is written to the rebuild's own copies rather than the tree. The clock is only checked between nodes, so the
+// first few nodes of a very large tree can each run over the budget on their own. Returns true once there's no rebuild left.
+bool KDTreeManager::ContinueRebuild(int budgetMicroseconds)
+{
+	ProfileZone zone("KDTreeManager::ContinueRebuild");
+	if (!_rebuilding) return true;
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	while (!_buildStack.empty())
+	{
+		BuildTask task = _buildStack.back();
+		_buildStack.pop_back();
+		KDTreeNode* node = _kdTree[task.node];
+		BuiltNode& built = _buildNodes[task.node];
 
-		// Now that the vector is sorted, find the median
-		int medianIndex = start + (end - start) / 2;
-		if (_kdTree[node]->axis == X_Axis) ActivateNode(_kdTree[node], _shapes[medianIndex]->transform().position.x);
-		if (_kdTree[node]->axis == Y_Axis) ActivateNode(_kdTree[node], _shapes[medianIndex]->transform().position.y);
+		built.start = task.start;
+		built.end = task.end;
+		built.live = task.live;
+		built.median = task.start;
 
-		if (_kdTree[node]->depth < _maxDepth && medianIndex != start && medianIndex != end)
+		// An empty node is left inactive, as is everything below it
+		if (task.live > 0)
 		{
-			startStack.push(start);
-			endStack.push(medianIndex - 1);
-			nodeStack.push(_kdTree[node]->left);
+			int leftLive = (task.live - 1) / 2;
+			int medianIndex = PartitionShapes(_buildShapes, node->axis, task.start, task.end, task.live);
+			built.median = medianIndex;
+			built.active = true;
+			built.axisValue = GetShapePosition(_buildShapes[medianIndex], node->axis);
+
+			if (node->depth < _maxMaxDepth)
+			{
+				SetSlot(_buildSlots, _buildShapes[medianIndex], medianIndex);
 
-			startStack.push(medianIndex + 1);
-			endStack.push(end);
-			nodeStack.push(_kdTree[node]->right);
+				BuildTask left = { node->left, task.start, medianIndex - 1, leftLive };
+				_buildStack.push_back(left);
+				BuildTask right = { node->right, medianIndex + 1, task.end, task.live - 1 - leftLive };
+				_buildStack.push_back(right);
+			}
+			else
+			{
+				for (int i = task.start; i <= task.end; ++i)
+				{
+					if (_buildShapes[i] != NO_SHAPE) SetSlot(_buildSlots, _buildShapes[i], i);
+				}
+			}
 		}
+
+		if (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() >= budgetMicroseconds) break;
 	}
 
+	if (!_buildStack.empty()) return false;
+
+	FinishRebuild();
+	return true;
+}
+
+// Swaps the finished rebuild in for the tree. The rebuild sorted the shapes that were in the tree when it started, so any shape
+// inserted or removed since then is taken out of the new tree and put back if it's still meant to be there.
+void KDTreeManager::FinishRebuild()
+{
+	ProfileZone zone("KDTreeManager::FinishRebuild");
+	_rebuilding = false;
+	++_stats.rebuilds;
+
+	unsigned int numChanges = _buildChanges.size();
+	for (unsigned int i = 0; i < numChanges; ++i)
+	{
+		_buildChanges[i].second = GetSlot(_slots, _buildChanges[i].first) >= 0;
+	}
+
+	_shapes.swap(_buildShapes);
+	_slots.swap(_buildSlots);
+
+	// Parents come before their children in the node array, so each division line is fit to lines that are already in place
+	unsigned int size = _kdTree.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		KDTreeNode* node = _kdTree[i];
+		const BuiltNode& built = _buildNodes[i];
+		node->start = built.start;
+		node->end = built.end;
+		node->median = built.median;
+		node->live = built.live;
+		if (built.active)
+		{
+			ActivateNode(node, built.axisValue);
+		}
+		else
+		{
+			DeactivateNode(node);
+		}
+	}
+
+	for (unsigned int i = 0; i < numChanges; ++i)
+	{
+		RemoveShape(_buildChanges[i].first);
+		if (_buildChanges[i].second) InsertShape(_buildChanges[i].first);
+	}
+	ClearBuildChanges();
+}
+
+// Makes room for the shape in everything that grows with the number of shapes, so that neither the tree nor a time-sliced
+// rebuild of it has to allocate once the shapes are all added. There can't be more shapes in the tree than the shape store
+// has handed out handles, and the shape's own handle is one of those.
+void KDTreeManager::ReserveShape(ShapeHandle handle)
+{
+	unsigned int numShapes = std::max((unsigned int)ShapeStore::shapes().size(), handle + 1);
+	unsigned int numSlots = numShapes + (unsigned int)(numShapes * SLACK_RATIO);
+	ReserveAtLeast(_shapes, numSlots);
+	ReserveAtLeast(_buildShapes, numSlots);
+	ReserveAtLeast(_buildSlots, numShapes);
+	ReserveAtLeast(_buildChanges, numShapes);
+	if (_slots.size() < numShapes) _slots.resize(numShapes, -1);
+	if (_buildChanged.size() < numShapes) _buildChanged.resize(numShapes, false);
+}
+
+// Notes a shape that was inserted or removed while a rebuild is under way. A shape that moves is removed and inserted again,
+// but it only has to be put right once when the rebuild finishes.
+void KDTreeManager::RecordBuildChange(ShapeHandle handle)
+{
+	if (!_rebuilding) return;
+	if (handle >= _buildChanged.size()) _buildChanged.resize(handle + 1, false);
+	if (_buildChanged[handle]) return;
+	_buildChanged[handle] = true;
+	_buildChanges.push_back(std::make_pair(handle, false));
+}
+
+void KDTreeManager::ClearBuildChanges()
+{
+	unsigned int numChanges = _buildChanges.size();
+	for (unsigned int i = 0; i < numChanges; ++i)
+	{
+		_buildChanged[_buildChanges[i].first] = false;
+	}
+	_buildChanges.clear();
+}
+
+bool KDTreeManager::rebuilding()
+{
+	return _rebuilding;
 }
 
 void KDTreeManager::AddShape(InteractiveShape* shape)
 {
-	_shapes.push_back(shape);
+	ReserveShape(shape->handle());
+	_shapes.push_back(shape->handle());
 }
 
-void KDTreeManager::DumpData()
+// Inserts a single shape without rebuilding the whole tree. The shape follows its position down one root-to-leaf
+// path and is dropped into a free slot on its side of the deepest node it reaches. If there is no room there, the
+// smallest subtree on the path that still has a free slot is rebuilt with the shape included. The shape array only
+// grows once the entire tree is full.
+void KDTreeManager::InsertShape(InteractiveShape* shape)
+{
+	ReserveShape(shape->handle());
+	InsertShape(shape->handle());
+}
+
+void KDTreeManager::InsertShape(ShapeHandle handle)
 {
-	int i;
-	while ((i = _kdTree.size()) > 0)
+	RecordBuildChange(handle);
+
+	KDTreeNode* node = _kdTree[0];
+	bool left = false;
+	while (node->active)
 	{
-		delete _kdTree[i - 1];
-		_kdTree.pop_back();
+		float pos = GetShapePosition(handle, node->axis);
+		left = pos < node->axisValue;
+		if (node->depth == _maxMaxDepth) break;
+		node = _kdTree[left ? node->left : node->right];
 	}
+
+	if (!node->active && node->end >= node->start)
+	{
+		// An empty subtree with room in it, the shape becomes its only member
+		_shapes[node->start] = handle;
+		BuildSubtree(node->index, node->start, node->end, 1);
+		if (node->parent >= 0)
+		{
+			AdjustLiveCounts(node->parent, 1);
+			RebalancePath(node->parent);
+		}
+		return;
+	}
+
+	if (node->active)
+	{
+		// The bottom of the tree, look for an empty slot in the bucket on the shape's side of the median
+		int start = left ? node->start : node->median + 1;
+		int end = left ? node->median - 1 : node->end;
+		for (int i = start; i <= end; ++i)
+		{
+			if (_shapes[i] == NO_SHAPE)
+			{
+				_shapes[i] = handle;
+				SetSlot(_slots, handle, i);
+				AdjustLiveCounts(node->index, 1);
+				RebalancePath(node->index);
+				return;
+			}
+		}
+	}
+
+	// There is no room on the shape's side, so walk back up and rebuild the smallest subtree with a free slot
+	while (node->end - node->start + 1 == node->live && node->parent >= 0)
+	{
+		node = _kdTree[node->parent];
+	}
+	if (node->end - node->start + 1 == node->live)
+	{
+		int extra = 1 + (int)(node->live * SLACK_RATIO);
+		_shapes.resize(_shapes.size() + extra, NO_SHAPE);
+		node->end = (int)_shapes.size() - 1;
+	}
+	RebuildSubtree(node->index, handle);
+	if (node->parent >= 0)
+	{
+		AdjustLiveCounts(node->parent, 1);
+		RebalancePath(node->parent);
+	}
+}
+
+// Removes a shape by emptying its slot. The slot is left where it is so that it can be reused by a later insertion,
+// and only the live counts along the slot's root-to-leaf path change.
+void KDTreeManager::RemoveShape(InteractiveShape* shape)
+{
+	RemoveShape(shape->handle());
+}
+
+void KDTreeManager::RemoveShape(ShapeHandle handle)
+{
+	RecordBuildChange(handle);
+
+	int slot = GetSlot(_slots, handle);
+	if (slot < 0) return;
+	_slots[handle] = -1;
+	_shapes[slot] = NO_SHAPE;
+
+	// Find the node that owns the slot, either as its median or in its bucket
+	KDTreeNode* node = _kdTree[0];
+	while (slot != node->median && node->depth < _maxMaxDepth)
+	{
+		KDTreeNode* child = _kdTree[slot < node->median ? node->left : node->right];
+		if (!child->active) break;
+		node = child;
+	}
+
+	AdjustLiveCounts(node->index, -1);
+	if (node->live == 0)
+	{
+		DeactivateSubtree(node->index);
+	}
+	RebalancePath(node->index);
+}
+
+// A shape that has moved is taken out of its old slot and inserted again from its new position
+void KDTreeManager::MoveShape(InteractiveShape* shape)
+{
+	ShapeHandle handle = shape->handle();
+	RemoveShape(handle);
+	InsertShape(handle);
+}
+
+// Packs the shapes in a node's range to the front, adds the extra shape if one is given, and sorts them back into
+// that node's subtree. Nothing outside of the node's range is touched.
+void KDTreeManager::RebuildSubtree(int nodeIndex, ShapeHandle extraShape)
+{
+	ProfileZone zone("KDTreeManager::RebuildSubtree");
+	KDTreeNode* node = _kdTree[nodeIndex];
+	int write = node->start;
+	for (int i = node->start; i <= node->end; ++i)
+	{
+		if (_shapes[i] != NO_SHAPE) _shapes[write++] = _shapes[i];
+	}
+	if (extraShape != NO_SHAPE) _shapes[write++] = extraShape;
+	for (int i = write; i <= node->end; ++i)
+	{
+		_shapes[i] = NO_SHAPE;
+	}
+	++_stats.subdivisions;
+	_stats.subdivisionShapes += write - node->start;
+
+	BuildSubtree(nodeIndex, node->start, node->end, write - node->start);
+}
+
+// Walks from the given node up to the root and rebuilds the first, and therefore smallest, subtree that has one side
+// holding more than its share of the shapes. Small subtrees are left alone since searching them is already cheap.
+void KDTreeManager::RebalancePath(int nodeIndex)
+{
+	while (nodeIndex >= 0)
+	{
+		KDTreeNode* node = _kdTree[nodeIndex];
+		if (node->active && node->depth < _maxMaxDepth && node->live > MIN_REBALANCE_SIZE)
+		{
+			int heavier = std::max(_kdTree[node->left]->live, _kdTree[node->right]->live);
+			if (heavier > BALANCE_ALPHA * node->live)
+			{
+				RebuildSubtree(nodeIndex, NO_SHAPE);
+				return;
+			}
+		}
+		nodeIndex = node->parent;
+	}
+}
+
+void KDTreeManager::AdjustLiveCounts(int nodeIndex, int delta)
+{
+	while (nodeIndex >= 0)
+	{
+		_kdTree[nodeIndex]->live += delta;
+		nodeIndex = _kdTree[nodeIndex]->parent;
+	}
+}
+
+// The nodes all came out of the node pool, so they're freed along with it
+void KDTreeManager::DumpData()
+{
+	_nodePool.Clear();
+	_kdTree.clear();
+
+	_rebuilding = false;
+	_buildShapes.clear();
+	_buildSlots.clear();
+	_buildNodes.clear();
+	_buildStack.clear();
+	_buildChanges.clear();
+	_buildChanged.clear();
 }
 
 // This function represents the main advantage of using a K-D tree, and that is searching. A K-D tree allows for binary
-// searching when dealing with multiple dividng variables. 
-void KDTreeManager::GetNearbyShapes(InteractiveShape* shape, std::vector<InteractiveShape*>& shapeVec)
+// searching when dealing with multiple dividng variables. The search stops at the given depth, or the current max depth
+// if none is given, so coarser queries can be made without changing the tree. Asking for more depth than the tree was built
+// to goes as deep as it was built. Since every node's shapes sit next to each
+// other in the shape array, the result is just a view of that part of the array and nothing is copied.
+ShapeRange KDTreeManager::GetNearbyShapes(InteractiveShape* shape, int depthLimit)
 {
+	if (depthLimit < 0) depthLimit = _maxDepth;
+	if (depthLimit > _maxMaxDepth) depthLimit = _maxMaxDepth;
+	ShapeHandle handle = shape->handle();
+
 	unsigned int size = _kdTree.size();
 	float pos;
 	KDTreeNode* node;
-	int numShapes, start, end, medianIndex;
-	bool xAxis;
+	int start, end;
 	for (unsigned int i = 0; i < size;)
 	{
 		node = _kdTree[i];
-		xAxis = node->axis == X_Axis;
-		pos = xAxis ? shape->transform().position.x : shape->transform().position.y;
-		// Go down the tree until we have a hit unless we hit a dividing shape. 
-		if (pos != node->axisValue && node->depth < _maxDepth)
+		pos = GetShapePosition(handle, node->axis);
+		// Go down the tree until we have a hit unless we hit a dividing shape or the bottom of the built tree. 
+		if (pos != node->axisValue && node->depth < depthLimit && _kdTree[pos < node->axisValue ? node->left : node->right]->active)
 			i = pos < node->axisValue ? node->left : node->right;
 		else
 		{
-			medianIndex = node->start + (node->end - node->start) / 2;
 			// Decide which side of the median we're on and return all of the shapes on the side we're on.
 			// But if we're actually on the median, then return both sides.
 			if (pos <= node->axisValue)
 			{
 				start = node->start;
-				end = medianIndex - 1;
+				end = node->median - 1;
 				if (pos == node->axisValue)
 					end = node->end;
 			}
 			else
 			{
-				start = medianIndex + 1;
+				start = node->median + 1;
 				end = node->end;
 			}
 
-			numShapes = end - start + 1;
-			shapeVec.resize(numShapes);
-			for (int j = 0; j < numShapes; ++j)
+			++_stats.nearbyQueries;
+			if (end < start) break;
+			// A side of a node is exactly its child's range, so the child's live count is how many shapes it holds.
+			// Only the buckets at the bottom of the tree have no count of their own and have to be looked through.
+			if (pos == node->axisValue)
 			{
-				shapeVec[j] = _shapes[start + j];
+				_stats.nearbyCandidates += node->live;
+			}
+			else if (node->depth < _maxMaxDepth)
+			{
+				_stats.nearbyCandidates += _kdTree[pos < node->axisValue ? node->left : node->right]->live;
+			}
+			else
+			{
+				for (int j = start; j <= end; ++j)
+				{
+					_stats.nearbyCandidates += _shapes[j] != NO_SHAPE;
+				}
+			}
+			return ShapeRange(&_shapes[start], &_shapes[end] + 1);
+		}
+	}
+	return ShapeRange();
+}
+
+// Finds the k shapes closest to the given point. The results are written closest first, and any entries past the number of
+// shapes found are set to null. Returns how many shapes were found.
+int KDTreeManager::GetNearestShapes(glm::vec2 point, int k, InteractiveShape** results, float* distSq)
+{
+	if (_nearestScratch.empty()) _nearestScratch.resize(1);
+	int found = SearchNearest(point, k, _nearestScratch[0]);
+	WriteNearest(found, k, _nearestScratch[0], results, distSq);
+	return found;
+}
+
+// Spreads the interleaving bits of a 16 bit value out so that another value's bits can be slotted in between them
+static unsigned int SpreadBits(unsigned int v)
+{
+	v &= 0x0000ffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+// Runs a k nearest neighbor search for every point, writing the k results for point i starting at results[i * k]. The
+// points are visited in Morton order so that consecutive searches on a thread walk mostly the same nodes, and the batch
+// is split across the JobManager's threads. The tree must not change while the batch runs.
+void KDTreeManager::GetNearestShapes(const glm::vec2* points, int numPoints, int k, InteractiveShape** results, float* distSq)
+{
+	if (numPoints <= 0) return;
+
+	// Quantize the points within their own bounds and order them along a Z-curve
+	glm::vec2 low = points[0];
+	glm::vec2 high = points[0];
+	for (int i = 1; i < numPoints; ++i)
+	{
+		low = glm::min(low, points[i]);
+		high = glm::max(high, points[i]);
+	}
+	glm::vec2 extent = high - low;
+	glm::vec2 scale = glm::vec2(extent.x > 0.0f ? 65535.0f / extent.x : 0.0f, extent.y > 0.0f ? 65535.0f / extent.y : 0.0f);
+
+	_batchOrder.resize(numPoints);
+	for (int i = 0; i < numPoints; ++i)
+	{
+		glm::vec2 cell = (points[i] - low) * scale;
+		_batchOrder[i] = std::make_pair(SpreadBits((unsigned int)cell.x) | (SpreadBits((unsigned int)cell.y) << 1), i);
+	}
+	std::sort(_batchOrder.begin(), _batchOrder.end());
+
+	if (_nearestScratch.size() < JobManager::numThreads()) _nearestScratch.resize(JobManager::numThreads());
+
+	JobManager::ParallelFor(numPoints, NEAREST_BATCH_CHUNK, [&](int begin, int end, unsigned int thread)
+	{
+		NearestScratch& scratch = _nearestScratch[thread];
+		for (int i = begin; i < end; ++i)
+		{
+			int query = _batchOrder[i].second;
+			int found = SearchNearest(points[query], k, scratch);
+			WriteNearest(found, k, scratch, results + query * k, distSq ? distSq + query * k : nullptr);
+		}
+	});
+}
+
+// Keeps the k closest shapes seen so far in a max-heap, so the furthest of them is always at the front
+static void OfferNearest(std::pair<float, ShapeHandle>* best, int& found, int k, float dist, ShapeHandle shape)
+{
+	if (found < k)
+	{
+		best[found++] = std::make_pair(dist, shape);
+		std::push_heap(best, best + found);
+	}
+	else if (dist < best[0].first)
+	{
+		std::pop_heap(best, best + k);
+		best[k - 1] = std::make_pair(dist, shape);
+		std::push_heap(best, best + k);
+	}
+}
+
+// A depth-first search that visits the side of each division containing the point first. The other side is only searched
+// if the dividing line is closer than the furthest of the best k shapes found so far. Bottom level buckets are scanned whole.
+int KDTreeManager::SearchNearest(glm::vec2 point, int k, NearestScratch& scratch)
+{
+	std::vector<std::pair<int, float>>& stack = scratch.stack;
+	stack.clear();
+	if (k <= 0 || !_kdTree[0]->active) return 0;
+	if ((int)scratch.best.size() < k) scratch.best.resize(k);
+	std::pair<float, ShapeHandle>* best = &scratch.best[0];
+	int found = 0;
+
+	stack.push_back(std::make_pair(0, 0.0f));
+	while (!stack.empty())
+	{
+		KDTreeNode* node = _kdTree[stack.back().first];
+		float bound = stack.back().second;
+		stack.pop_back();
+
+		if (found == k && bound >= best[0].first) continue;
+
+		bool bucket = node->depth == _maxMaxDepth;
+		int start = bucket ? node->start : node->median;
+		int end = bucket ? node->end : node->median;
+		for (int i = start; i <= end; ++i)
+		{
+			ShapeHandle shape = _shapes[i];
+			if (shape == NO_SHAPE) continue;
+			glm::vec2 offset = GetShapePosition(shape) - point;
+			OfferNearest(best, found, k, glm::dot(offset, offset), shape);
+		}
+		if (bucket) continue;
+
+		float diff = (node->axis == X_Axis ? point.x : point.y) - node->axisValue;
+		int nearChild = diff < 0.0f ? node->left : node->right;
+		int farChild = diff < 0.0f ? node->right : node->left;
+		// The far side goes on the stack first so that the near side is searched first
+		if (_kdTree[farChild]->active) stack.push_back(std::make_pair(farChild, std::max(bound, diff * diff)));
+		if (_kdTree[nearChild]->active) stack.push_back(std::make_pair(nearChild, bound));
+	}
+
+	std::sort_heap(best, best + found);
+	return found;
+}
+
+void KDTreeManager::WriteNearest(int found, int k, NearestScratch& scratch, InteractiveShape** results, float* distSq)
+{
+	for (int i = 0; i < k; ++i)
+	{
+		results[i] = i < found ? ShapeStore::shapes()[scratch.best[i].second] : nullptr;
+		if (distSq) distSq[i] = i < found ? scratch.best[i].first : FLT_MAX;
+	}
+}
+
+// The squared distance between the closest points of two boxes
+static float BoxDistSq(const glm::vec2& minA, const glm::vec2& maxA, const glm::vec2& minB, const glm::vec2& maxB)
+{
+	glm::vec2 gap = glm::max(glm::max(minA - maxB, minB - maxA), glm::vec2(0.0f));
+	return glm::dot(gap, gap);
+}
+
+// Splits a set of shapes for the dual-tree search into the node's own shapes and its active children's subtrees, or leaves it
+// whole if it's already just the node's own shapes. Parts with no shapes are left out. Returns the number of parts.
+int KDTreeManager::SplitDualPart(int node, bool own, DualPart* parts)
+{
+	if (own)
+	{
+		parts[0] = DualPart(node, true);
+		return 1;
+	}
+
+	int numParts = 0;
+	KDTreeNode* kdNode = _kdTree[node];
+	if (!_dualNodes[node].ownEmpty) parts[numParts++] = DualPart(node, true);
+	if (_kdTree[kdNode->left]->active) parts[numParts++] = DualPart(kdNode->left, false);
+	if (_kdTree[kdNode->right]->active) parts[numParts++] = DualPart(kdNode->right, false);
+	return numParts;
+}
+
+// Finds the k nearest neighbors of every shape in the tree at once by searching the tree against itself. The shapes are
+// written to shapes[0 .. numShapes()) and the neighbors of shapes[i], closest first and not including the shape itself,
+// are written starting at results[i * k]. Entries past the number of neighbors found are set to null.
+//
+// Rather than running one search per shape, whole groups of shapes are searched together. A pair of nodes is skipped as
+// soon as the boxes around them are further apart than the worst k-th neighbor distance of any shape in the query node,
+// so one test can rule out a whole subtree for a whole subtree of shapes.
+void KDTreeManager::GetAllNearestShapes(int k, InteractiveShape** shapes, InteractiveShape** results, float* distSq)
+{
+	ProfileZone zone("KDTreeManager::GetAllNearestShapes");
+	if (k <= 0 || !_kdTree[0]->active) return;
+
+	unsigned int numSlots = _shapes.size();
+	_allFound.assign(numSlots, 0);
+	_allBest.resize(numSlots * k);
+
+	// Fit boxes around each node's own shapes and around its entire subtree. Children are always stored after their parent,
+	// so walking the nodes backwards finishes every child before its parent. A node with no shapes of its own has nothing
+	// left to find, so its own bound starts at zero rather than holding up the bounds above it.
+	_dualNodes.resize(_kdTree.size());
+	for (int n = (int)_kdTree.size() - 1; n >= 0; --n)
+	{
+		KDTreeNode* node = _kdTree[n];
+		DualNode& dual = _dualNodes[n];
+		if (!node->active) continue;
+
+		dual.ownMin = glm::vec2(FLT_MAX);
+		dual.ownMax = glm::vec2(-FLT_MAX);
+		dual.ownEmpty = true;
+		bool bucket = node->depth == _maxMaxDepth;
+		int start = bucket ? node->start : node->median;
+		int end = bucket ? node->end : node->median;
+		for (int i = start; i <= end; ++i)
+		{
+			if (_shapes[i] == NO_SHAPE) continue;
+			glm::vec2 pos = GetShapePosition(_shapes[i]);
+			dual.ownMin = glm::min(dual.ownMin, pos);
+			dual.ownMax = glm::max(dual.ownMax, pos);
+			dual.ownEmpty = false;
+		}
+		dual.subMin = dual.ownMin;
+		dual.subMax = dual.ownMax;
+		if (!bucket)
+		{
+			for (int c = 0; c < 2; ++c)
+			{
+				int child = c == 0 ? node->left : node->right;
+				if (!_kdTree[child]->active) continue;
+				dual.subMin = glm::min(dual.subMin, _dualNodes[child].subMin);
+				dual.subMax = glm::max(dual.subMax, _dualNodes[child].subMax);
 			}
-			break;
+		}
+		dual.ownBound = dual.ownEmpty ? 0.0f : FLT_MAX;
+		dual.subBound = FLT_MAX;
+	}
+
+	// Each entry pairs a set of query shapes with a set of reference shapes, where each set is either a node's own shapes or
+	// its whole subtree. Two own sets are searched against each other directly. Anything bigger is split into the node's own
+	// shapes and its two child subtrees on each side that covers a subtree, and every query part is paired with every
+	// reference part, so each pair of shapes is still visited exactly once while the boxes being tested keep shrinking on
+	// both sides.
+	_dualStack.clear();
+	_dualStack.push_back(DualPair(0, 0, false, false));
+	while (!_dualStack.empty())
+	{
+		DualPair pair = _dualStack.back();
+		_dualStack.pop_back();
+		KDTreeNode* query = _kdTree[pair.query];
+		KDTreeNode* reference = _kdTree[pair.reference];
+		DualNode& dualQuery = _dualNodes[pair.query];
+		DualNode& dualReference = _dualNodes[pair.reference];
+		bool queryBucket = query->depth == _maxMaxDepth;
+		bool referenceBucket = reference->depth == _maxMaxDepth;
+		// A bucket has no children, so its own shapes are its whole subtree
+		bool queryOwn = pair.queryOwn || queryBucket;
+		bool referenceOwn = pair.referenceOwn || referenceBucket;
+
+		if (!queryOwn)
+		{
+			// Children only ever tighten their bounds, so refreshing from them is always safe
+			float bound = dualQuery.ownBound;
+			if (_kdTree[query->left]->active) bound = std::max(bound, _dualNodes[query->left].subBound);
+			if (_kdTree[query->right]->active) bound = std::max(bound, _dualNodes[query->right].subBound);
+			dualQuery.subBound = bound;
+		}
+		float queryBound = queryOwn ? dualQuery.ownBound : dualQuery.subBound;
+		if (BoxDistSq(queryOwn ? dualQuery.ownMin : dualQuery.subMin, queryOwn ? dualQuery.ownMax : dualQuery.subMax,
+			referenceOwn ? dualReference.ownMin : dualReference.subMin, referenceOwn ? dualReference.ownMax : dualReference.subMax) > queryBound)
+		{
+			continue;
+		}
+
+		if (queryOwn && referenceOwn)
+		{
+			// Search the query node's own shapes against the reference node's own shapes
+			int queryStart = queryBucket ? query->start : query->median;
+			int queryEnd = queryBucket ? query->end : query->median;
+			int referenceStart = referenceBucket ? reference->start : reference->median;
+			int referenceEnd = referenceBucket ? reference->end : reference->median;
+			float ownBound = 0.0f;
+			for (int i = queryStart; i <= queryEnd; ++i)
+			{
+				ShapeHandle shape = _shapes[i];
+				if (shape == NO_SHAPE) continue;
+				glm::vec2 pos = GetShapePosition(shape);
+				std::pair<float, ShapeHandle>* best = &_allBest[i * k];
+				if (BoxDistSq(pos, pos, dualReference.ownMin, dualReference.ownMax) <= (_allFound[i] == k ? best[0].first : FLT_MAX))
+				{
+					for (int j = referenceStart; j <= referenceEnd; ++j)
+					{
+						ShapeHandle other = _shapes[j];
+						if (other == NO_SHAPE || other == shape) continue;
+						glm::vec2 offset = GetShapePosition(other) - pos;
+						OfferNearest(best, _allFound[i], k, glm::dot(offset, offset), other);
+					}
+				}
+				ownBound = std::max(ownBound, _allFound[i] == k ? best[0].first : FLT_MAX);
+			}
+			dualQuery.ownBound = ownBound;
+			if (queryBucket) dualQuery.subBound = ownBound;
+			continue;
+		}
+
+		// Split each side that covers a subtree into its own shapes and its active children. A child's entry in the boxes is
+		// only filled in while it's active, so that's checked before anything is read from it.
+		DualPart queryParts[3];
+		DualPart referenceParts[3];
+		int numQueryParts = SplitDualPart(pair.query, queryOwn, queryParts);
+		int numReferenceParts = SplitDualPart(pair.reference, referenceOwn, referenceParts);
+		for (int q = 0; q < numQueryParts; ++q)
+		{
+			const DualNode& dualPart = _dualNodes[queryParts[q].node];
+			const glm::vec2& partMin = queryParts[q].own ? dualPart.ownMin : dualPart.subMin;
+			const glm::vec2& partMax = queryParts[q].own ? dualPart.ownMax : dualPart.subMax;
+			for (int r = 0; r < numReferenceParts; ++r)
+			{
+				const DualNode& dualOther = _dualNodes[referenceParts[r].node];
+				referenceParts[r].distSq = referenceParts[r].own ?
+					BoxDistSq(partMin, partMax, dualOther.ownMin, dualOther.ownMax) :
+					BoxDistSq(partMin, partMax, dualOther.subMin, dualOther.subMax);
+			}
+
+			// The closest reference part goes on the stack last so that it's searched first and tightens the bound before
+			// the further ones are tested
+			for (int r = 1; r < numReferenceParts; ++r)
+			{
+				for (int s = r; s > 0 && referenceParts[s - 1].distSq < referenceParts[s].distSq; --s)
+				{
+					std::swap(referenceParts[s - 1], referenceParts[s]);
+				}
+			}
+			for (int r = 0; r < numReferenceParts; ++r)
+			{
+				_dualStack.push_back(DualPair(queryParts[q].node, referenceParts[r].node, queryParts[q].own, referenceParts[r].own));
+			}
+		}
+	}
+
+	std::vector<InteractiveShape*>& storeShapes = ShapeStore::shapes();
+	int shapeIndex = 0;
+	for (unsigned int i = 0; i < numSlots; ++i)
+	{
+		if (_shapes[i] == NO_SHAPE) continue;
+		std::pair<float, ShapeHandle>* best = &_allBest[i * k];
+		std::sort_heap(best, best + _allFound[i]);
+		shapes[shapeIndex] = storeShapes[_shapes[i]];
+		for (int j = 0; j < k; ++j)
+		{
+			results[shapeIndex * k + j] = j < _allFound[i] ? storeShapes[best[j].second] : nullptr;
+			if (distSq) distSq[shapeIndex * k + j] = j < _allFound[i] ? best[j].first : FLT_MAX;
+		}
+		++shapeIndex;
+	}
+}
+
+int KDTreeManager::numShapes()
+{
+	return _kdTree[0]->live;
+}
+
+// Fills in the stats from the running counts and the active nodes. A K-D tree has no most shapes per node to split on, so the
+// subdivisions counted are the subtrees rebuilt when an insert found no free slot or a subtree became lopsided, and the rebuilds
+// are full rebuilds, whether done at once or a slice at a time. Nodes above the bottom of the tree each hold just their median,
+// and the bottom nodes hold their buckets. The medians above the query depth sit on a division that the queries go past, so
+// those are the straddling shapes.
+void KDTreeManager::GetStats(TreeStats& stats)
+{
+	stats = _stats;
+	stats.ClearNodes();
+	unsigned int size = _kdTree.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		KDTreeNode* node = _kdTree[i];
+		if (!node->active) continue;
+		if (node->depth < _maxMaxDepth)
+		{
+			stats.CountNode(node->depth, _shapes[node->median] != NO_SHAPE ? 1 : 0);
+			if (node->depth < _maxDepth && _shapes[node->median] != NO_SHAPE) ++stats.straddlingShapes;
+		}
+		else
+		{
+			stats.CountNode(node->depth, node->live);
 		}
 	}
 }
 
+void KDTreeManager::ResetStats()
+{
+	_stats.Reset();
+}
+
+// Slots in the shape array that are empty and can take an inserted shape
+int KDTreeManager::freeSlots()
+{
+	return (int)_shapes.size() - _kdTree[0]->live;
+}
+
 KDTreeNode* KDTreeManager::InitNode(int depth, int parentIndex, int branchMod, int index, Child child, Axis axis)
 {
-	KDTreeNode* node = new KDTreeNode();
+	KDTreeNode* node = _nodePool.Create();
 	node->axis = axis;
 	node->axisValue = 0.0f;
 	node->left = -1;
@@ -216,7 +1059,9 @@ KDTreeNode* KDTreeManager::InitNode(int depth, int parentIndex, int branchMod, i
 	RenderManager::AddShape(line);
 	node->divider = line;
 	node->start = 0;
-	node->end = 0;
+	node->end = -1;
+	node->median = 0;
+	node->live = 0;
 
 	return node;
 }
@@ -228,11 +1073,35 @@ void KDTreeManager::DeactivateNode(KDTreeNode* node)
 	node->axisValue = 0.0f;
 }
 
+// Deactivates a node along with everything below it. Since a node is never active beneath an inactive one, the
+// walk stops as soon as it reaches an inactive node.
+void KDTreeManager::DeactivateSubtree(int nodeIndex)
+{
+	_deactivateStack.clear();
+	_deactivateStack.push_back(nodeIndex);
+
+	while (!_deactivateStack.empty())
+	{
+		KDTreeNode* node = _kdTree[_deactivateStack.back()];
+		_deactivateStack.pop_back();
+
+		if (node->active)
+		{
+			DeactivateNode(node);
+			if (node->left >= 0)
+			{
+				_deactivateStack.push_back(node->left);
+				_deactivateStack.push_back(node->right);
+			}
+		}
+	}
+}
+
 // Most of this code is here for defining the transforms of the dividing lines, entirely aesthetic
 void KDTreeManager::ActivateNode(KDTreeNode* node, float axisValue)
 {
 	node->active = true;
-	node->divider->active() = true;
+	node->divider->active() = node->depth <= _maxDepth;
 	if (node->axis == X_Axis)
 	{
 		float top;
@@ -327,8 +1196,13 @@ void KDTreeManager::SetMaxDepth(int newMaxDepth)
 {
 	if (newMaxDepth >= 0 && newMaxDepth != _maxDepth && newMaxDepth <= _maxMaxDepth)
 	{
+		// The tree is already sorted to the deepest level, so only the visible division lines change
 		_maxDepth = newMaxDepth;
-		UpdateKDtree();
+		unsigned int size = _kdTree.size();
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			_kdTree[i]->divider->active() = _kdTree[i]->active && _kdTree[i]->depth <= _maxDepth;
+		}
 	}
 }
 
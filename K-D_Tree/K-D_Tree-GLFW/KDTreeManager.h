@@ -1,5 +1,9 @@
 #pragma once
+#include <GLM\glm.hpp>
 #include <vector>
+#include "NodePool.h"
+#include "TreeStats.h"
+#include "ShapeStore.h"
 
 class InteractiveShape;
 class RenderShape;
@@ -40,14 +44,57 @@ struct KDTreeNode
 	int branchMod;
 	// This node's location in the entire node array
 	int index;
-	// The range of objects that this node has within its division
+	// The range of objects that this node has within its division. The range may contain empty slots
+	// left behind by removed shapes or reserved for future insertions.
 	int start;
 	int end;
+	// The slot holding the shape this node divides on
+	int median;
+	// The number of shapes (not empty slots) within this node's range
+	int live;
 	// The beginning and ending locations of the visual line showing this node's division
 	float lineStart;
 	float lineEnd;
 };
 
+// A view of a run of shapes sitting next to each other in the K-D tree's shape array. Nothing is copied, so the view is only
+// valid until the tree next changes. Empty slots within the run are skipped while iterating. The tree holds handles, and each
+// one is only looked up in the shape store as the iterator hands it out.
+class ShapeRange
+{
+public:
+
+	class iterator
+	{
+	public:
+		iterator(const ShapeHandle* pos, const ShapeHandle* end) : _pos(pos), _end(end) { SkipEmpty(); }
+
+		InteractiveShape* operator*() const { return ShapeStore::shapes()[*_pos]; }
+		ShapeHandle handle() const { return *_pos; }
+		iterator& operator++() { ++_pos; SkipEmpty(); return *this; }
+		bool operator==(const iterator& other) const { return _pos == other._pos; }
+		bool operator!=(const iterator& other) const { return _pos != other._pos; }
+
+	private:
+
+		void SkipEmpty() { while (_pos != _end && *_pos == NO_SHAPE) ++_pos; }
+
+		const ShapeHandle* _pos;
+		const ShapeHandle* _end;
+	};
+
+	ShapeRange(const ShapeHandle* first = nullptr, const ShapeHandle* last = nullptr) : _first(first), _last(last) {}
+
+	iterator begin() const { return iterator(_first, _last); }
+	iterator end() const { return iterator(_last, _last); }
+	bool empty() const { return begin() == end(); }
+
+private:
+
+	const ShapeHandle* _first;
+	const ShapeHandle* _last;
+};
+
 class KDTreeManager
 {
 public:
@@ -56,11 +103,48 @@ public:
 
 	static void UpdateKDtree();
 
+	static void BeginRebuild();
+
+	static bool ContinueRebuild(int budgetMicroseconds);
+
+	static bool rebuilding();
+
 	static void AddShape(InteractiveShape* shape);
 
+	static void InsertShape(InteractiveShape* shape);
+
+	static void RemoveShape(InteractiveShape* shape);
+
+	static void MoveShape(InteractiveShape* shape);
+
 	static void DumpData();
 
-	static void GetNearbyShapes(InteractiveShape* shape, std::vector<InteractiveShape*>& shapeVec);
+	static ShapeRange GetNearbyShapes(InteractiveShape* shape, int depthLimit = -1);
+
+	// Calls the visitor with each shape near the given shape
+	template <typename Visitor>
+	static void GetNearbyShapes(InteractiveShape* shape, Visitor visitor, int depthLimit = -1)
+	{
+		ShapeRange range = GetNearbyShapes(shape, depthLimit);
+		for (ShapeRange::iterator it = range.begin(); it != range.end(); ++it)
+		{
+			visitor(*it);
+		}
+	}
+
+	static int GetNearestShapes(glm::vec2 point, int k, InteractiveShape** results, float* distSq = nullptr);
+
+	static void GetNearestShapes(const glm::vec2* points, int numPoints, int k, InteractiveShape** results, float* distSq = nullptr);
+
+	static void GetAllNearestShapes(int k, InteractiveShape** shapes, InteractiveShape** results, float* distSq = nullptr);
+
+	static int numShapes();
+
+	static int freeSlots();
+
+	static void GetStats(TreeStats& stats);
+
+	static void ResetStats();
 
 	static void SetMaxDepth(int newMaxDepth);
 
@@ -68,16 +152,135 @@ public:
 
 private:
 
+	// Working space for a nearest neighbor search, kept around so that searches don't allocate
+	struct NearestScratch
+	{
+		// Max-heap of the best shapes found so far, keyed on squared distance
+		std::vector<std::pair<float, ShapeHandle>> best;
+		// Nodes still to visit along with a lower bound on the squared distance to anything in them
+		std::vector<std::pair<int, float>> stack;
+	};
+
+	// Boxes and neighbor distance bounds for a node while searching the tree against itself. The own values cover only the
+	// shapes stored at the node itself, the sub values cover the node's entire subtree.
+	struct DualNode
+	{
+		glm::vec2 ownMin;
+		glm::vec2 ownMax;
+		glm::vec2 subMin;
+		glm::vec2 subMax;
+		// The largest k-th neighbor distance of any shape covered so far, no pair further apart than this can matter
+		float ownBound;
+		float subBound;
+		bool ownEmpty;
+	};
+
+	// A query set paired with a reference set, where each set is either a node's own shapes or its entire subtree
+	struct DualPair
+	{
+		int query;
+		int reference;
+		bool queryOwn;
+		bool referenceOwn;
+
+		DualPair(int queryNode, int referenceNode, bool queryOwnOnly, bool referenceOwnOnly) :
+			query(queryNode), reference(referenceNode), queryOwn(queryOwnOnly), referenceOwn(referenceOwnOnly) {}
+	};
+
+	// One side of a dual pair after splitting, along with its distance to the part it's being paired with
+	struct DualPart
+	{
+		int node;
+		bool own;
+		float distSq;
+
+		DualPart() {}
+		DualPart(int partNode, bool ownOnly) : node(partNode), own(ownOnly), distSq(0.0f) {}
+	};
+
+	// A node still to be sorted, along with the part of the shape array it gets
+	struct BuildTask
+	{
+		int node;
+		int start;
+		int end;
+		int live;
+	};
+
+	// What a time-sliced rebuild worked out for a node, copied into the tree once the whole rebuild is done
+	struct BuiltNode
+	{
+		int start;
+		int end;
+		int median;
+		int live;
+		bool active;
+		float axisValue;
+	};
+
+	static void FinishRebuild();
+
+	static void ReserveShape(ShapeHandle handle);
+
+	static void RecordBuildChange(ShapeHandle handle);
+
+	static void ClearBuildChanges();
+
+	static int SearchNearest(glm::vec2 point, int k, NearestScratch& scratch);
+
+	static void WriteNearest(int found, int k, NearestScratch& scratch, InteractiveShape** results, float* distSq);
+
+	static int SplitDualPart(int node, bool own, DualPart* parts);
+
 	static KDTreeNode* InitNode(int depth, int parentIndex, int branchMod, int index, Child child, Axis axis);
 
+	static void BuildSubtree(int nodeIndex, int start, int end, int live);
+
+	static void InsertShape(ShapeHandle handle);
+
+	static void RemoveShape(ShapeHandle handle);
+
+	static void RebuildSubtree(int nodeIndex, ShapeHandle extraShape);
+
+	static void RebalancePath(int nodeIndex);
+
+	static void AdjustLiveCounts(int nodeIndex, int delta);
+
 	static void DeactivateNode(KDTreeNode* node);
 
+	static void DeactivateSubtree(int nodeIndex);
+
 	static void ActivateNode(KDTreeNode* node, float axisValue);
 
 	static int GetDepthIndex(int depth);
 
 	static std::vector<KDTreeNode*> _kdTree;
-	static std::vector<InteractiveShape*> _shapes;
+	static NodePool<KDTreeNode> _nodePool;
+	// Every slot holds a shape's handle, or NO_SHAPE if it's empty, so searching the tree only ever reads the shape store's arrays
+	static std::vector<ShapeHandle> _shapes;
+	// The slot each shape is in, indexed by the shape's handle, or -1 for shapes that aren't in the tree
+	static std::vector<int> _slots;
+	static std::vector<NearestScratch> _nearestScratch;
+	static std::vector<std::pair<unsigned int, int>> _batchOrder;
+	static std::vector<DualNode> _dualNodes;
+	static std::vector<DualPair> _dualStack;
+	static std::vector<std::pair<float, ShapeHandle>> _allBest;
+	static std::vector<int> _allFound;
+	// The shape array, slots, nodes and remaining work of a time-sliced rebuild, kept apart from the tree until it's done
+	static bool _rebuilding;
+	static std::vector<ShapeHandle> _buildShapes;
+	static std::vector<int> _buildSlots;
+	static std::vector<BuiltNode> _buildNodes;
+	static std::vector<BuildTask> _buildStack;
+	// Shapes inserted into or removed from the tree while a rebuild was under way, and whether each is still in the tree. Each
+	// shape is only listed once, and which ones are listed is kept by handle.
+	static std::vector<std::pair<ShapeHandle, bool>> _buildChanges;
+	static std::vector<bool> _buildChanged;
+	// The nodes still to visit while building or deactivating a subtree
+	static std::vector<BuildTask> _taskStack;
+	static std::vector<int> _deactivateStack;
+	// The running counts for the stats. The rest of the stats are worked out from the nodes when they're asked for.
+	static TreeStats _stats;
 	static int _maxDepth;
 	static int _maxMaxDepth;
 	static RenderShape _lineTemplate;
@@ -0,0 +1,84 @@
+#pragma once
+#include <vector>
+#include <cstdlib>
+#include <new>
+
+// Hands out nodes from a few large blocks of memory instead of making each one with its own new. Nodes made one after another
+// sit next to each other in memory, and every block starts on a cache line. Nodes are never given back one at a time, so a
+// tree that wants to reuse a node keeps track of it itself, and everything is freed at once by Clear.
+template <typename T>
+class NodePool
+{
+public:
+
+	NodePool() : _blockSize(0), _used(0) {}
+
+	~NodePool() { Clear(); }
+
+	// Sets how many nodes each block holds. A tree that knows how many nodes it will ever need can pass that number here so
+	// that all of its nodes come out of a single allocation.
+	void Init(unsigned int blockSize)
+	{
+		Clear();
+		_blockSize = blockSize > 0 ? blockSize : 1;
+		AddBlock();
+	}
+
+	T* Create()
+	{
+		if (_blocks.empty() || _used == _blockSize)
+		{
+			AddBlock();
+		}
+		return new (_blocks.back() + _used++) T();
+	}
+
+	// Destroys every node made so far and frees the blocks they were in. When the nodes have nothing to clean up themselves,
+	// the loops over them do nothing and only the blocks are freed.
+	void Clear()
+	{
+		unsigned int numBlocks = _blocks.size();
+		for (unsigned int i = 0; i < numBlocks; ++i)
+		{
+			unsigned int count = i + 1 == numBlocks ? _used : _blockSize;
+			for (unsigned int j = 0; j < count; ++j)
+			{
+				_blocks[i][j].~T();
+			}
+			free(_memory[i]);
+		}
+		_blocks.clear();
+		_memory.clear();
+		_used = 0;
+	}
+
+	// The number of nodes made since the pool was last cleared
+	unsigned int size() const { return _blocks.empty() ? 0 : (_blocks.size() - 1) * _blockSize + _used; }
+
+private:
+
+	// Copying a pool would free its blocks twice
+	NodePool(const NodePool&);
+	NodePool& operator=(const NodePool&);
+
+	static const unsigned int CACHE_LINE_SIZE = 64;
+
+	// The memory is asked for with a cache line to spare, and the block starts at the first cache line boundary within it
+	void AddBlock()
+	{
+		if (_blockSize == 0) _blockSize = 1;
+		void* memory = malloc(_blockSize * sizeof(T) + CACHE_LINE_SIZE - 1);
+		if (!memory) throw std::bad_alloc();
+		size_t aligned = ((size_t)memory + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+		_memory.push_back(memory);
+		_blocks.push_back((T*)aligned);
+		_used = 0;
+	}
+
+	std::vector<T*> _blocks;
+	// What malloc gave back for each block, which is what has to be freed
+	std::vector<void*> _memory;
+	unsigned int _blockSize;
+	// How many nodes of the last block have been handed out
+	unsigned int _used;
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <ostream>
+
+// One timed zone, with its start and length in nanoseconds since the program started
+struct ProfileEvent
+{
+	const char* name;
+	long long start;
+	long long duration;
+};
+
+// Records how long named zones of code take on every thread. Each thread writes only to its own ring of events, so recording
+// a zone never takes a lock, and once a ring is full the oldest events are written over. The events can be written out as a
+// Chrome trace (chrome://tracing) or summed up into a report of how long each zone takes. Zone names have to be string
+// literals, since only the pointer is kept.
+class Profiler
+{
+public:
+
+	// Profiling has to be turned on before any threads are started, since each thread's ring is only made if it is
+	static void SetEnabled(bool enabled);
+
+	static bool enabled();
+
+	static void NameThread(const char* name);
+
+	static void Record(const char* name, long long start, long long end);
+
+	static long long now();
+
+	static bool WriteChromeTrace(const char* path);
+
+	static void WriteReport(std::ostream& out);
+
+	static void Clear();
+
+private:
+
+	struct ThreadLog
+	{
+		std::thread::id id;
+		const char* name;
+		std::vector<ProfileEvent> events;
+		// How many events this thread has ever recorded. The next one goes at written % RING_SIZE.
+		unsigned long long written;
+	};
+
+	static ThreadLog* GetLog();
+
+	static void GetEvents(const ThreadLog* log, std::vector<ProfileEvent>& events);
+
+	static const unsigned int MAX_THREADS = 64;
+	static const unsigned int RING_SIZE = 16384;
+
+	// Logs are only ever added, and a log is filled in before the count is raised, so threads can look through them without a lock
+	static ThreadLog* _logs[MAX_THREADS];
+	static std::atomic<unsigned int> _numLogs;
+	static std::mutex _mutex;
+	static bool _enabled;
+	static std::chrono::high_resolution_clock::time_point _epoch;
+};
+
+// Times the scope it's made in and records it with the profiler when it ends. Does nothing while profiling is off.
+class ProfileZone
+{
+public:
+
+	ProfileZone(const char* name) : _name(name), _start(Profiler::enabled() ? Profiler::now() : -1) {}
+
+	~ProfileZone()
+	{
+		if (_start >= 0) Profiler::Record(_name, _start, Profiler::now());
+	}
+
+private:
+
+	ProfileZone(const ProfileZone&);
+	ProfileZone& operator=(const ProfileZone&);
+
+	const char* _name;
+	long long _start;
+};
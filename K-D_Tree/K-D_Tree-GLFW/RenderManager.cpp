@@ -4,7 +4,14 @@
 #include "Init_Shader.h"
 #include "InputManager.h"
 #include "KDTreeManager.h"
+#include "ShapeStore.h"
+#include "JobManager.h"
+#include "Profiler.h"
 #include <GLM\gtc\random.hpp>
+#include <algorithm>
+
+// How many shapes each thread updates at a time
+static const int UPDATE_CHUNK_SIZE = 256;
 
 std::vector<RenderShape*> RenderManager::_shapes = std::vector<RenderShape*>();
 std::vector<InteractiveShape*> RenderManager::_interactiveShapes = std::vector<InteractiveShape*>();
@@ -12,6 +19,8 @@ std::vector<InteractiveShape*> RenderManager::_interactiveShapes = std::vector<I
 glm::mat4 RenderManager::_projMat = glm::ortho(-1.337f, 1.337f, -1.0f, 1.0f);
 
 bool RenderManager::_shapeMoved = false;
+NodePool<RenderManager::UpdateResult> RenderManager::_updateResultPool;
+std::vector<RenderManager::UpdateResult*> RenderManager::_updateResults = std::vector<RenderManager::UpdateResult*>();
 
 void RenderManager::GenerateShapes(Shader shader, GLuint vao, int numShapes, GLenum type, GLsizei count)
 {
@@ -32,6 +41,10 @@ void RenderManager::AddShape(Shader shader, GLuint vao, GLenum type, GLsizei cou
 {
 	_interactiveShapes.push_back(new InteractiveShape(collider, vao, count, type, shader, color));
 	_interactiveShapes[_interactiveShapes.size() - 1]->transform() = transform;
+	// The shape store moves interactive shapes, so the transform's position and velocity are handed over to it
+	_interactiveShapes[_interactiveShapes.size() - 1]->SetPosition(glm::vec2(transform.position.x, transform.position.y));
+	_interactiveShapes[_interactiveShapes.size() - 1]->SetVelocity(glm::vec2(transform.linearVelocity.x, transform.linearVelocity.y));
+	_interactiveShapes[_interactiveShapes.size() - 1]->transform().linearVelocity = glm::vec3();
 }
 
 void RenderManager::AddShape(Shader shader, GLuint vao, GLenum type, GLsizei count, glm::vec4 color, Transform transform)
@@ -46,31 +59,81 @@ void RenderManager::AddShape(RenderShape* shape)
 	_shapes[_shapes.size() - 1]->transform() = shape->transform();
 }
 
+// Shapes are updated in chunks spread across the job manager's threads. A shape's update only touches the shape itself and its
+// own slot in the shape store, so the threads never share anything while they work. Anything that changes the tree is left for
+// afterwards, when each thread's results are merged on this thread.
 void RenderManager::Update(float dt)
 {
+	ProfileZone zone("RenderManager::Update");
 	_shapeMoved = false;
-	std::vector<InteractiveShape*>& moused = std::vector<InteractiveShape*>();
-	unsigned int numShapes = _shapes.size();
-	for (unsigned int i = 0; i < numShapes; ++i)
+	JobManager::ParallelFor((int)_shapes.size(), UPDATE_CHUNK_SIZE, [dt](int begin, int end, unsigned int /*thread*/)
 	{
-		_shapes[i]->Update(dt);
+		for (int i = begin; i < end; ++i)
+		{
+			_shapes[i]->Update(dt);
+		}
+	});
+
+	// Every interactive shape is moved in one pass over the shape store before the shapes themselves catch up with it
+	ShapeStore::Integrate(dt);
+
+	static_assert(sizeof(UpdateResult) == CACHE_LINE_SIZE, "Each thread's result has to fill exactly one cache line");
+	if (_updateResults.size() < JobManager::numThreads())
+	{
+		_updateResultPool.Init(JobManager::numThreads());
+		_updateResults.clear();
+		for (unsigned int i = 0; i < JobManager::numThreads(); ++i)
+		{
+			_updateResults.push_back(_updateResultPool.Create());
+		}
 	}
-	numShapes = _interactiveShapes.size();
-	for (unsigned int i = 0; i < numShapes; ++i)
+	unsigned int numResults = _updateResults.size();
+	// Any one thread could end up moving every shape, so each has room for all of them and never grows its list mid-update
+	unsigned int numInteractiveShapes = _interactiveShapes.size();
+	for (unsigned int i = 0; i < numResults; ++i)
+	{
+		_updateResults[i]->movedShapes.clear();
+		_updateResults[i]->movedShapes.reserve(numInteractiveShapes);
+		_updateResults[i]->mousedIndex = -1;
+	}
+	JobManager::ParallelFor((int)_interactiveShapes.size(), UPDATE_CHUNK_SIZE, [dt](int begin, int end, unsigned int thread)
 	{
-		_interactiveShapes[i]->Update(dt);
-		if (_interactiveShapes[i]->moved()) _shapeMoved = true;
-		if (_interactiveShapes[i]->mouseOver()) KDTreeManager::GetNearbyShapes(_interactiveShapes[i], moused);
+		UpdateResult& result = *_updateResults[thread];
+		for (int i = begin; i < end; ++i)
+		{
+			_interactiveShapes[i]->Update(dt);
+			if (_interactiveShapes[i]->moved()) result.movedShapes.push_back(_interactiveShapes[i]);
+			if (_interactiveShapes[i]->mouseOver()) result.mousedIndex = std::max(result.mousedIndex, i);
+		}
+	});
+
+	int mousedIndex = -1;
+	for (unsigned int i = 0; i < numResults; ++i)
+	{
+		unsigned int numMoved = _updateResults[i]->movedShapes.size();
+		for (unsigned int j = 0; j < numMoved; ++j)
+		{
+			_shapeMoved = true;
+			KDTreeManager::MoveShape(_updateResults[i]->movedShapes[j]);
+		}
+		mousedIndex = std::max(mousedIndex, _updateResults[i]->mousedIndex);
 	}
-	unsigned int size = moused.size();
-	for (unsigned int i = 0; i < size; ++i)
+
+	// The tree is only queried once every shape has been moved into place, since moving a shape can change what the
+	// query result points at
+	if (mousedIndex >= 0)
 	{
-		moused[i]->currentColor() = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+		ShapeRange nearby = KDTreeManager::GetNearbyShapes(_interactiveShapes[mousedIndex]);
+		for (ShapeRange::iterator it = nearby.begin(); it != nearby.end(); ++it)
+		{
+			(*it)->currentColor() = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+		}
 	}
 }
 
 void RenderManager::Draw()
 {
+	ProfileZone zone("RenderManager::Draw");
 	unsigned int numShapes = _shapes.size();
 	for (unsigned int i = 0; i < numShapes; ++i)
 	{
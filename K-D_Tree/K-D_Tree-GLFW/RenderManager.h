@@ -2,6 +2,7 @@
 #include <GLEW\GL\glew.h>
 #include <GLM\gtc\matrix_transform.hpp>
 #include <vector>
+#include "NodePool.h"
 
 struct Transform;
 struct Collider;
@@ -38,4 +39,20 @@ private:
 	static glm::mat4 _projMat;
 
 	static bool _shapeMoved;
+
+	static const unsigned int CACHE_LINE_SIZE = 64;
+
+	// What each thread found while updating its share of the interactive shapes: the shapes that were let go of and need moving
+	// in the tree, and the index of the last shape with the mouse over it, or -1 for none. Threads can steal chunks from anywhere
+	// in the list, so the last shape is the one with the highest index. These are merged once every thread is done. Each is
+	// padded out to a cache line and made in the pool, whose blocks start on a cache line, so that no two threads' results
+	// share a line. A vector's memory isn't lined up like that.
+	struct UpdateResult
+	{
+		std::vector<InteractiveShape*> movedShapes;
+		int mousedIndex;
+		char padding[CACHE_LINE_SIZE - sizeof(std::vector<InteractiveShape*>) - sizeof(int)];
+	};
+	static NodePool<UpdateResult> _updateResultPool;
+	static std::vector<UpdateResult*> _updateResults;
 };
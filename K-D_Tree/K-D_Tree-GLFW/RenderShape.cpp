@@ -20,7 +20,11 @@ void RenderShape::Update(float dt)
 {
 	// Update values
 	_transform.position += _transform.linearVelocity * dt;
-	_transform.rotation = glm::slerp(_transform.rotation, _transform.rotation * _transform.angularVelocity, dt);
+	// Most shapes never spin, and slerping toward the rotation they already have would leave it as it is anyway
+	if (_transform.angularVelocity != glm::quat())
+	{
+		_transform.rotation = glm::slerp(_transform.rotation, _transform.rotation * _transform.angularVelocity, dt);
+	}
 
 	_currentColor = _color;
 }
@@ -0,0 +1,161 @@
+#include "ShapeStore.h"
+#include <limits>
+#include <xmmintrin.h>
+
+std::vector<float> ShapeStore::_x = std::vector<float>();
+std::vector<float> ShapeStore::_y = std::vector<float>();
+std::vector<float> ShapeStore::_halfWidth = std::vector<float>();
+std::vector<float> ShapeStore::_halfHeight = std::vector<float>();
+std::vector<float> ShapeStore::_velocityX = std::vector<float>();
+std::vector<float> ShapeStore::_velocityY = std::vector<float>();
+std::vector<ShapeBox> ShapeStore::_boxes = std::vector<ShapeBox>();
+std::vector<unsigned char> ShapeStore::_flags = std::vector<unsigned char>();
+std::vector<InteractiveShape*> ShapeStore::_shapes = std::vector<InteractiveShape*>();
+std::vector<ShapeHandle> ShapeStore::_freeHandles = std::vector<ShapeHandle>();
+glm::vec2 ShapeStore::_boundsMin = glm::vec2(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+glm::vec2 ShapeStore::_boundsMax = glm::vec2(std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+
+// Fills the most recently emptied slot if there is one, otherwise every array grows by one. The shape starts out still.
+ShapeHandle ShapeStore::AddShape(InteractiveShape* shape, const glm::vec2& center, const glm::vec2& halfSize)
+{
+	ShapeHandle handle;
+	if (!_freeHandles.empty())
+	{
+		handle = _freeHandles.back();
+		_freeHandles.pop_back();
+	}
+	else
+	{
+		handle = _flags.size();
+		_x.push_back(0.0f);
+		_y.push_back(0.0f);
+		_halfWidth.push_back(0.0f);
+		_halfHeight.push_back(0.0f);
+		_velocityX.push_back(0.0f);
+		_velocityY.push_back(0.0f);
+		_boxes.push_back(ShapeBox());
+		_flags.push_back(0);
+		_shapes.push_back(nullptr);
+	}
+
+	_x[handle] = center.x;
+	_y[handle] = center.y;
+	_halfWidth[handle] = halfSize.x;
+	_halfHeight[handle] = halfSize.y;
+	_velocityX[handle] = 0.0f;
+	_velocityY[handle] = 0.0f;
+	_flags[handle] = Shape_Live;
+	_shapes[handle] = shape;
+	UpdateBox(handle);
+	return handle;
+}
+
+void ShapeStore::RemoveShape(ShapeHandle handle)
+{
+	_flags[handle] = 0;
+	_shapes[handle] = nullptr;
+	_freeHandles.push_back(handle);
+}
+
+void ShapeStore::SetBounds(const glm::vec2& boundsMin, const glm::vec2& boundsMax)
+{
+	_boundsMin = boundsMin;
+	_boundsMax = boundsMax;
+}
+
+// Moves one value along its velocity, stops it at the walls and turns the velocity around if it got there
+static void IntegrateAxis(float& position, float& velocity, float dt, float wallMin, float wallMax)
+{
+	position += velocity * dt;
+	position = position > wallMax ? wallMax : position;
+	position = position < wallMin ? wallMin : position;
+	if (position == wallMax || position == wallMin)
+	{
+		velocity *= -1.0f;
+	}
+}
+
+// The same as above for four shapes at once. The clamp is a min and a max, and instead of branching, the velocities of the shapes
+// at a wall have their sign bits flipped.
+static void IntegrateAxis(float* position, float* velocity, __m128 dt, __m128 wallMin, __m128 wallMax)
+{
+	__m128 signBit = _mm_set1_ps(-0.0f);
+	__m128 pos = _mm_loadu_ps(position);
+	__m128 vel = _mm_loadu_ps(velocity);
+	pos = _mm_add_ps(pos, _mm_mul_ps(vel, dt));
+	pos = _mm_max_ps(_mm_min_ps(pos, wallMax), wallMin);
+	__m128 atWall = _mm_or_ps(_mm_cmpeq_ps(pos, wallMax), _mm_cmpeq_ps(pos, wallMin));
+	vel = _mm_xor_ps(vel, _mm_and_ps(atWall, signBit));
+	_mm_storeu_ps(position, pos);
+	_mm_storeu_ps(velocity, vel);
+}
+
+// Moves every shape along its velocity over the time step. A shape that reaches a wall is stopped there and turned around on
+// that axis. Shapes are taken four at a time with SSE, and whatever is left over at the end is done one at a time. Empty slots
+// are moved along with everything else since nothing reads them, which keeps every group of four whole. Every shape's box is
+// brought up to date on the way through, so nothing that reads them later in the frame has to work them out again.
+void ShapeStore::Integrate(float dt)
+{
+	unsigned int size = _flags.size();
+	unsigned int i = 0;
+	if (size >= 4)
+	{
+		__m128 dt4 = _mm_set1_ps(dt);
+		__m128 minX = _mm_set1_ps(_boundsMin.x);
+		__m128 minY = _mm_set1_ps(_boundsMin.y);
+		__m128 maxX = _mm_set1_ps(_boundsMax.x);
+		__m128 maxY = _mm_set1_ps(_boundsMax.y);
+		for (; i + 4 <= size; i += 4)
+		{
+			IntegrateAxis(&_x[i], &_velocityX[i], dt4, minX, maxX);
+			IntegrateAxis(&_y[i], &_velocityY[i], dt4, minY, maxY);
+			UpdateBox(i);
+			UpdateBox(i + 1);
+			UpdateBox(i + 2);
+			UpdateBox(i + 3);
+		}
+	}
+	for (; i < size; ++i)
+	{
+		IntegrateAxis(_x[i], _velocityX[i], dt, _boundsMin.x, _boundsMax.x);
+		IntegrateAxis(_y[i], _velocityY[i], dt, _boundsMin.y, _boundsMax.y);
+		UpdateBox(i);
+	}
+}
+
+// Has to be called whenever a shape is moved outside of Integrate, such as when it's dragged, for its box to stay right
+void ShapeStore::UpdateBox(ShapeHandle handle)
+{
+	ShapeBox& box = _boxes[handle];
+	box.min.x = _x[handle] - _halfWidth[handle];
+	box.min.y = _y[handle] - _halfHeight[handle];
+	box.max.x = _x[handle] + _halfWidth[handle];
+	box.max.y = _y[handle] + _halfHeight[handle];
+}
+
+void ShapeStore::DumpData()
+{
+	_x.clear();
+	_y.clear();
+	_halfWidth.clear();
+	_halfHeight.clear();
+	_velocityX.clear();
+	_velocityY.clear();
+	_boxes.clear();
+	_flags.clear();
+	_shapes.clear();
+	_freeHandles.clear();
+}
+
+// Counts empty slots as well as live ones
+unsigned int ShapeStore::size() { return _flags.size(); }
+
+std::vector<float>& ShapeStore::x() { return _x; }
+std::vector<float>& ShapeStore::y() { return _y; }
+std::vector<float>& ShapeStore::halfWidth() { return _halfWidth; }
+std::vector<float>& ShapeStore::halfHeight() { return _halfHeight; }
+std::vector<float>& ShapeStore::velocityX() { return _velocityX; }
+std::vector<float>& ShapeStore::velocityY() { return _velocityY; }
+std::vector<ShapeBox>& ShapeStore::boxes() { return _boxes; }
+std::vector<unsigned char>& ShapeStore::flags() { return _flags; }
+std::vector<InteractiveShape*>& ShapeStore::shapes() { return _shapes; }
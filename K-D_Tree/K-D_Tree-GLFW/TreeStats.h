@@ -0,0 +1,79 @@
+#pragma once
+#include <vector>
+#include <ostream>
+
+// How a tree is shaped right now, along with counts of what it has done since its counters were last reset. Meant for spotting a
+// tree that has gone wrong, such as one with every shape stuck in the root, while the program is running.
+struct TreeStats
+{
+	static const unsigned int HISTOGRAM_SIZE = 16;
+
+	// Active nodes at each depth, the root's first
+	std::vector<unsigned int> nodesPerDepth;
+	// How many active nodes hold each number of shapes themselves. The last entry counts every node holding that many or more.
+	unsigned int shapesPerNode[HISTOGRAM_SIZE];
+	// Shapes held above the bottom of the tree because they straddle one of its divisions
+	unsigned int straddlingShapes;
+	// Calls to GetNearbyShapes, and how many shapes they handed back between them
+	unsigned long long nearbyQueries;
+	unsigned long long nearbyCandidates;
+	// Times the whole tree was built again from scratch
+	unsigned int rebuilds;
+	// Nodes split because they held too many shapes, and how many shapes had to be sorted again to split them
+	unsigned int subdivisions;
+	unsigned long long subdivisionShapes;
+	// Nodes whose children were folded back into them
+	unsigned int collapses;
+
+	TreeStats() { Reset(); }
+
+	void Reset()
+	{
+		ClearNodes();
+		nearbyQueries = 0;
+		nearbyCandidates = 0;
+		rebuilds = 0;
+		subdivisions = 0;
+		subdivisionShapes = 0;
+		collapses = 0;
+	}
+
+	// Zeroes what's counted from the nodes, leaving the running counts alone
+	void ClearNodes()
+	{
+		nodesPerDepth.clear();
+		for (unsigned int i = 0; i < HISTOGRAM_SIZE; ++i)
+		{
+			shapesPerNode[i] = 0;
+		}
+		straddlingShapes = 0;
+	}
+
+	void CountNode(unsigned int depth, unsigned int numShapes)
+	{
+		if (depth >= nodesPerDepth.size()) nodesPerDepth.resize(depth + 1, 0);
+		++nodesPerDepth[depth];
+		++shapesPerNode[numShapes < HISTOGRAM_SIZE ? numShapes : HISTOGRAM_SIZE - 1];
+	}
+
+	// Writes everything out on a single line. Only the histogram entries with nodes in them are written.
+	void Write(std::ostream& out) const
+	{
+		out << "nodes per depth";
+		for (unsigned int i = 0; i < nodesPerDepth.size(); ++i)
+		{
+			out << ' ' << nodesPerDepth[i];
+		}
+		out << " | shapes per node";
+		for (unsigned int i = 0; i < HISTOGRAM_SIZE; ++i)
+		{
+			if (shapesPerNode[i] == 0) continue;
+			out << ' ' << i << (i == HISTOGRAM_SIZE - 1 ? "+:" : ":") << shapesPerNode[i];
+		}
+		out << " | straddling " << straddlingShapes;
+		out << " | nearby " << nearbyQueries << " queries, " << (nearbyQueries ? (double)nearbyCandidates / nearbyQueries : 0.0) << " shapes each";
+		out << " | rebuilds " << rebuilds;
+		out << " | subdivisions " << subdivisions << ", " << subdivisionShapes << " shapes";
+		out << " | collapses " << collapses << std::endl;
+	}
+};
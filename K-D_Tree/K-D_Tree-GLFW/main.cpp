@@ -42,7 +42,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *
 *	3) KDTreeManager
 *	- This class maintains an array of references to InteractiveShapes and sorts them into the K-DTree. Furthermore it maintains references to
-*	and updates the transforms of the green division lines to show the borders of the nodes.
+*	and updates the transforms of the green division lines to show the borders of the nodes. Shapes can be inserted, removed and
+*	moved one at a time, in which case only the smallest subtree that needs it is re-sorted rather than the entire array.
+*
+*	4) JobManager
+*	- This class owns a set of worker threads and splits large batches of work, such as batched nearest neighbor searches and updating every shape, across them.
 *
 *	RenderShape
 *	- Holds the instance data for a shape that can be rendered to the screen. This includes a transform, a vao, a shader, the drawing
@@ -52,6 +56,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *	- Inherits from RenderShape, possessing all the same properties. Additionally, it has a collider and can use it to check collisions against
 *	world boundries, other colliders, and the cursor.
 *
+*	ShapeStore
+*	- Holds the position, size, velocity and flags of every InteractiveShape in separate arrays of plain values, indexed by a handle that each
+*	shape keeps. It moves every shape along its velocity and off the walls each frame, and the K-D tree reads its arrays directly.
+*
+*	AllocTracker
+*	- Counts the heap allocations made during each stage of a frame, and in strict mode stops the program at any made once it has warmed up.
+*
+*	Profiler
+*	- Times named zones of each frame on every thread, and writes them out as a Chrome trace and a report of how long each zone takes.
+*
+*	TreeStats
+*	- Describes the shape of a tree and counts what it has done, such as rebuilds and splits, for spotting a tree that has gone wrong.
+*
+*	NodePool
+*	- Hands out the tree's nodes from a few large blocks of memory, so that they sit next to each other and can all be freed at once.
+*
 *	Init_Shader
 *	- Contains static functions for loading, compiling and linking shaders.
 *
@@ -71,9 +91,29 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "RenderManager.h"
 #include "InputManager.h"
 #include "KDTreeManager.h"
+#include "JobManager.h"
+#include "ShapeStore.h"
+#include "AllocTracker.h"
+#include "Profiler.h"
 
 GLFWwindow* window;
 
+// How long the K-D tree may spend on a rebuild each frame, in microseconds
+const int REBUILD_BUDGET = 1000;
+
+// With strict allocations on, any heap allocation made during a frame once the program has warmed up stops it with a failed
+// assert. Either way the allocations made in each stage of the last frame can be looked at through the AllocTracker.
+bool strictAllocations = false;
+
+// With profiling on, each frame and the work done during it is timed on every thread. When the program closes, the timings are
+// written to trace.json, which can be opened in chrome://tracing, and a report of how long each zone took goes to the console.
+bool profileFrames = false;
+
+// With tree stats on, a line describing the shape of the tree and what it did during the frame is written to the console every
+// frame. The same stats can be asked for at any time between tree updates.
+bool dumpTreeStats = false;
+TreeStats treeStats;
+
 GLuint vertexShader;
 GLuint fragmentShader;
 GLuint shaderProgram;
@@ -187,10 +227,19 @@ void init()
 	time(&timer);
 	srand((unsigned int)timer);
 
+	ShapeStore::SetBounds(glm::vec2(-1.337f, -1.0f), glm::vec2(1.337f, 1.0f));
+
 	RenderManager::GenerateShapes(shader, vao0, 500, GL_TRIANGLES, 6);
 
 	InputManager::Init(window);
 
+	Profiler::SetEnabled(profileFrames);
+	Profiler::NameThread("Main");
+
+	JobManager::Init();
+
+	AllocTracker::SetStrict(strictAllocations);
+
 	KDTreeManager::InitKDTree(5, RenderShape(vao1, 2, GL_LINE_STRIP, shader, glm::vec4(0.0f, 1.0f, 0.3f, 1.0f)));
 	
 	unsigned int shapesSize = RenderManager::interactiveShapes().size();
@@ -203,6 +252,10 @@ void init()
 
 void step()
 {
+	ProfileZone frameZone("Frame");
+	AllocTracker::BeginFrame();
+	AllocTracker::BeginStage("Input");
+
 	// Clear to black
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -219,18 +272,43 @@ void step()
 	dDepth -= (InputManager::downKey(true) && !InputManager::downKey());
 	KDTreeManager::SetMaxDepth(KDTreeManager::maxDepth() + dDepth);
 
+	// Shapes that moved are moved within the tree as part of the update, so no full rebuild is needed
+	AllocTracker::BeginStage("Update");
 	RenderManager::Update(dt);
-	if (RenderManager::shapeMoved())
-		KDTreeManager::UpdateKDtree();
 
+	// Once inserts have used up most of the free slots in the tree, it's rebuilt a little each frame so that an insert never
+	// finds the tree full and has to rebuild the whole thing at once
+	AllocTracker::BeginStage("Rebuild");
+	if (!KDTreeManager::rebuilding() && KDTreeManager::freeSlots() < KDTreeManager::numShapes() / 8)
+	{
+		KDTreeManager::BeginRebuild();
+	}
+	KDTreeManager::ContinueRebuild(REBUILD_BUDGET);
+
+	if (dumpTreeStats)
+	{
+		KDTreeManager::GetStats(treeStats);
+		treeStats.Write(std::cout);
+		KDTreeManager::ResetStats();
+	}
+
+	AllocTracker::BeginStage("Draw");
 	RenderManager::Draw();
 
 	// Swap buffers
 	glfwSwapBuffers(window);
+
+	AllocTracker::EndFrame();
 }
 
 void cleanUp()
 {
+	if (profileFrames)
+	{
+		if (!Profiler::WriteChromeTrace("trace.json")) std::cerr << "Could not write trace.json" << std::endl;
+		Profiler::WriteReport(std::cout);
+	}
+
 	glDeleteProgram(shaderProgram);
 	glDeleteShader(vertexShader);
 	glDeleteShader(fragmentShader);
@@ -245,6 +323,10 @@ void cleanUp()
 
 	KDTreeManager::DumpData();
 
+	JobManager::DumpData();
+
+	ShapeStore::DumpData();
+
 	glfwTerminate();
 }
 
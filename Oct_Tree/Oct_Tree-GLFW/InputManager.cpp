@@ -1,4 +1,5 @@
 #include "InputManager.h"
+#include "Profiler.h"
 #include <iostream>
 
 double InputManager::_mousePos[2];
@@ -8,6 +9,8 @@ bool InputManager::_prevLeftMouseButton = false;
 bool InputManager::_prevRightMouseButton = false;
 bool InputManager::_spaceKey = false;
 bool InputManager::_prevSpaceKey = false;
+bool InputManager::_gKey = false;
+bool InputManager::_prevGKey = false;
 GLFWwindow* InputManager::_window;
 float InputManager::_aspectRatio = 0.0f;
 int InputManager::_windowSize[2];
@@ -21,12 +24,15 @@ void InputManager::Init(GLFWwindow* window)
 
 void InputManager::Update()
 {
+	ProfileZone zone("InputManager::Update");
 	_prevLeftMouseButton = _leftMouseButton;
 	_prevRightMouseButton = _rightMouseButton;
 	_leftMouseButton = glfwGetMouseButton(_window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
 	_rightMouseButton = glfwGetMouseButton(_window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
 	_prevSpaceKey = _spaceKey;
 	_spaceKey = glfwGetKey(_window, GLFW_KEY_SPACE) == GLFW_PRESS;
+	_prevGKey = _gKey;
+	_gKey = glfwGetKey(_window, GLFW_KEY_G) == GLFW_PRESS;
 	glfwGetCursorPos(_window, &_mousePos[0], &_mousePos[1]);
 }
 
@@ -37,6 +43,16 @@ glm::vec2 InputManager::GetMouseCoords()
 	ret.y = -(((float)_mousePos[1] / (float)_windowSize[1]) * 2.0f - 1.0f);
 	return ret;
 }
+
+// The mouse position in normalized device coordinates, which run from -1 to 1 across the window on both axes
+glm::vec2 InputManager::GetMouseDeviceCoords()
+{
+	glm::vec2 ret = glm::vec2();
+	ret.x = ((float)_mousePos[0] / (float)_windowSize[0]) * 2.0f - 1.0f;
+	ret.y = -(((float)_mousePos[1] / (float)_windowSize[1]) * 2.0f - 1.0f);
+	return ret;
+}
 bool InputManager::leftMouseButton(bool prev) { if (prev) return _prevLeftMouseButton; else return _leftMouseButton; }
 bool InputManager::rightMouseButton(bool prev) { if (prev) return _prevRightMouseButton; else return _rightMouseButton; }
-bool InputManager::spaceKey(bool prev) { if (prev) return _prevSpaceKey; else return _spaceKey; }
\ No newline at end of file
+bool InputManager::spaceKey(bool prev) { if (prev) return _prevSpaceKey; else return _spaceKey; }
+bool InputManager::gKey(bool prev) { if (prev) return _prevGKey; else return _gKey; }
\ No newline at end of file
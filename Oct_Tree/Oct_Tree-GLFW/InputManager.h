@@ -11,9 +11,11 @@ public:
 	static void Update();
 
 	static glm::vec2 GetMouseCoords();
+	static glm::vec2 GetMouseDeviceCoords();
 	static bool leftMouseButton(bool prev = false);
 	static bool rightMouseButton(bool prev = false);
 	static bool spaceKey(bool prev = false);
+	static bool gKey(bool prev = false);
 
 private:
 
@@ -24,6 +26,8 @@ private:
 	static bool _prevRightMouseButton;
 	static bool _spaceKey;
 	static bool _prevSpaceKey;
+	static bool _gKey;
+	static bool _prevGKey;
 	static GLFWwindow* _window;
 	static float _aspectRatio;
 	static int _windowSize[2];
@@ -7,38 +7,59 @@ InteractiveShape::InteractiveShape(Collider collider, GLint vao, GLsizei count,
 	_collider = collider;
 	_mouseOver = false;
 	_selected = false;
+	_dragDistance = 0.0f;
 	_active = true;
+	_handle = ShapeStore::AddShape(this, glm::vec3(collider.x, collider.y, collider.z), glm::vec3(collider.width, collider.height, collider.depth) / 2.0f);
 }
 
-InteractiveShape::~InteractiveShape(){}
+InteractiveShape::~InteractiveShape()
+{
+	ShapeStore::RemoveShape(_handle);
+}
 
+// The shape store has already moved the shape and bounced it off the walls, so the transform just catches up with it
 void InteractiveShape::Update(float dt)
 {
 	RenderShape::Update(dt);
+	_transform.position = position();
 
-	// Constrain position to the screen
-	_transform.position.x = _transform.position.x > 1.337f ? 1.337f : _transform.position.x;
-	_transform.position.x = _transform.position.x < -1.337f ? -1.337f : _transform.position.x;
-	_transform.position.y = _transform.position.y > 1.0f ? 1.0f : _transform.position.y;
-	_transform.position.y = _transform.position.y < -1.0f ? -1.0f : _transform.position.y;
-	_transform.position.z = _transform.position.z > -3.0f ? -3.0f : _transform.position.z;
-	_transform.position.z = _transform.position.z < -5.0f ? -5.0f : _transform.position.z;
-	if (_transform.position.x == 1.337f || _transform.position.x == -1.337f)
-	{
-		_transform.linearVelocity.x *= -1.0f;
-	}
-	if (_transform.position.y == 1.0f || _transform.position.y == -1.0f)
+	_mouseOut = false;
+}
+
+// Shapes no longer check the mouse themselves. Instead the render manager casts a ray from the cursor through the oct-tree and
+// calls this on the shape the ray hits, along with the shape that had the mouse before it. Returns true while the shape is
+// selected and being dragged, since it then keeps hold of the mouse even when the ray misses it.
+bool InteractiveShape::UpdateMouse(bool hit, const glm::vec3& rayOrigin, const glm::vec3& rayDirection)
+{
+	if (hit)
 	{
-		_transform.linearVelocity.y *= -1.0f;
+		if (!_selected)
+		{
+			// If this is the first time that the mouse is down, this shape is now selected
+			if (InputManager::leftMouseButton() && !InputManager::leftMouseButton(true))
+			{
+				_selected = true;
+				_dragDistance = glm::dot(_transform.position - rayOrigin, rayDirection);
+			}
+		}
+		else if (!InputManager::leftMouseButton())
+		{
+			_selected = false;
+		}
+		_mouseOver = true;
+		return false;
 	}
-	if (_transform.position.z == -3.0f || _transform.position.z == -5.0f)
+
+	if (_selected && InputManager::leftMouseButton())
 	{
-		_transform.linearVelocity.z *= -1.0f;
+		SetPosition(rayOrigin + rayDirection * _dragDistance);
+		return true;
 	}
 
-	_mouseOut = false;
-	// Check the mouse
-	glm::vec2 mousePos = InputManager::GetMouseCoords();
+	_selected = false;
+	_mouseOut = _mouseOver;
+	_mouseOver = false;
+	return false;
 }
 
 void InteractiveShape::Draw(const glm::mat4& viewProjMat)
@@ -46,12 +67,13 @@ void InteractiveShape::Draw(const glm::mat4& viewProjMat)
 	RenderShape::Draw(viewProjMat);
 }
 
-const Collider& InteractiveShape::collider()
+// The collider in world space, centered where the shape store has it
+Collider InteractiveShape::collider()
 {
 	Collider ret = _collider;
-	ret.x += _transform.position.x;
-	ret.y += _transform.position.y;
-	ret.z += _transform.position.z;
+	ret.x = ShapeStore::x()[_handle];
+	ret.y = ShapeStore::y()[_handle];
+	ret.z = ShapeStore::z()[_handle];
 	return ret;
 }
 
@@ -68,4 +90,32 @@ Collider InteractiveShape::MakeCollider(float width, float height, float depth,
 }
 
 bool InteractiveShape::mouseOver() { return _mouseOver; }
-bool InteractiveShape::mouseOut() { return _mouseOut; }
\ No newline at end of file
+bool InteractiveShape::mouseOut() { return _mouseOut; }
+float& InteractiveShape::mass() { return ShapeStore::mass()[_handle]; }
+ShapeHandle InteractiveShape::handle() { return _handle; }
+
+glm::vec3 InteractiveShape::position()
+{
+	return glm::vec3(ShapeStore::x()[_handle] - _collider.x, ShapeStore::y()[_handle] - _collider.y, ShapeStore::z()[_handle] - _collider.z);
+}
+
+void InteractiveShape::SetPosition(const glm::vec3& position)
+{
+	ShapeStore::x()[_handle] = position.x + _collider.x;
+	ShapeStore::y()[_handle] = position.y + _collider.y;
+	ShapeStore::z()[_handle] = position.z + _collider.z;
+	ShapeStore::UpdateBox(_handle);
+	_transform.position = position;
+}
+
+glm::vec3 InteractiveShape::velocity()
+{
+	return glm::vec3(ShapeStore::velocityX()[_handle], ShapeStore::velocityY()[_handle], ShapeStore::velocityZ()[_handle]);
+}
+
+void InteractiveShape::SetVelocity(const glm::vec3& velocity)
+{
+	ShapeStore::velocityX()[_handle] = velocity.x;
+	ShapeStore::velocityY()[_handle] = velocity.y;
+	ShapeStore::velocityZ()[_handle] = velocity.z;
+}
\ No newline at end of file
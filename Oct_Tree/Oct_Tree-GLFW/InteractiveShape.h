@@ -1,5 +1,6 @@
 #pragma once
 #include "RenderShape.h"
+#include "ShapeStore.h"
 
 struct Collider
 {
@@ -19,18 +20,31 @@ public:
 
 	void Update(float dt);
 
+	bool UpdateMouse(bool hit, const glm::vec3& rayOrigin, const glm::vec3& rayDirection);
+
 	void Draw(const glm::mat4& viewProjMat);
 
 	static Collider MakeCollider(float width, float height, float depth, float x, float y, float z);
 
-	const Collider& collider();
+	Collider collider();
 	bool mouseOver();
 	bool mouseOut();
+	float& mass();
+	ShapeHandle handle();
+
+	// The shape's position and velocity live in the shape store. Setting the position moves the shape's transform along with it.
+	glm::vec3 position();
+	void SetPosition(const glm::vec3& position);
+	glm::vec3 velocity();
+	void SetVelocity(const glm::vec3& velocity);
 
 private:
 
 	bool _selected;
 	bool _mouseOver;
 	bool _mouseOut;
+	// How far along the mouse ray the shape was when it was selected, so that it stays that far away while being dragged
+	float _dragDistance;
 	Collider _collider;
+	ShapeHandle _handle;
 };
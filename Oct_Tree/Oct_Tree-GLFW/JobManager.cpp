@@ -0,0 +1,254 @@
+#include "JobManager.h"
+#include "Profiler.h"
+#include <algorithm>
+
+std::vector<std::thread> JobManager::_workers;
+std::mutex JobManager::_mutex;
+std::condition_variable JobManager::_wake;
+std::condition_variable JobManager::_done;
+const RangeJob* JobManager::_job = nullptr;
+int JobManager::_count = 0;
+int JobManager::_chunkSize = 1;
+std::vector<JobManager::WorkQueue*> JobManager::_queues;
+int JobManager::_busyWorkers = 0;
+unsigned int JobManager::_generation = 0;
+bool JobManager::_quit = false;
+std::thread JobManager::_taskThread;
+std::mutex JobManager::_taskMutex;
+std::condition_variable JobManager::_taskWake;
+std::condition_variable JobManager::_taskDone;
+Task JobManager::_task = nullptr;
+bool JobManager::_taskPending = false;
+
+// The worker threads are started once and then sleep until there is a batch to help with. By default there is one worker
+// for each hardware thread besides the one calling Init, since the calling thread also works on every batch. One more thread
+// is started for background tasks.
+void JobManager::Init(int numWorkers)
+{
+	if (numWorkers < 0)
+	{
+		numWorkers = (int)std::thread::hardware_concurrency() - 1;
+		numWorkers = numWorkers < 0 ? 0 : numWorkers;
+	}
+
+	_quit = false;
+	for (int i = 0; i <= numWorkers; ++i)
+	{
+		WorkQueue* queue = new WorkQueue();
+		queue->begin = 0;
+		queue->end = 0;
+		_queues.push_back(queue);
+	}
+	for (int i = 0; i < numWorkers; ++i)
+	{
+		_workers.push_back(std::thread(WorkerLoop, i + 1));
+	}
+	_taskThread = std::thread(TaskLoop);
+}
+
+// Splits [0, count) into chunks and runs the job on each of them, spread across the calling thread and the workers. Each thread
+// starts out with an even share of the chunks in its own queue, so threads mostly work through neighboring chunks without
+// touching each other, and a thread that finishes early steals from the others, so uneven chunks still balance out. Returns
+// once every chunk is done. Only one batch runs at a time, so this must not be called from inside a job.
+void JobManager::ParallelFor(int count, int chunkSize, const RangeJob& job)
+{
+	if (count <= 0) return;
+	chunkSize = chunkSize < 1 ? 1 : chunkSize;
+
+	if (_workers.empty() || count <= chunkSize)
+	{
+		job(0, count, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_job = &job;
+		_count = count;
+		_chunkSize = chunkSize;
+		int numChunks = (count + chunkSize - 1) / chunkSize;
+		unsigned int numQueues = _queues.size();
+		for (unsigned int i = 0; i < numQueues; ++i)
+		{
+			std::lock_guard<std::mutex> queueLock(_queues[i]->mutex);
+			_queues[i]->begin = (int)((long long)numChunks * i / numQueues);
+			_queues[i]->end = (int)((long long)numChunks * (i + 1) / numQueues);
+		}
+		++_generation;
+	}
+	_wake.notify_all();
+
+	RunChunks(job, count, chunkSize, 0);
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	_done.wait(lock, [] { return _busyWorkers == 0; });
+	_job = nullptr;
+}
+
+// Starts the task on the background thread and returns right away. The thread is already running, so nothing is made or
+// allocated to start a task. Only one task runs at a time, and the last one has to have been waited on before the next is
+// started. A task may call ParallelFor, as long as the thread that started it doesn't while it runs.
+void JobManager::StartTask(Task task)
+{
+	{
+		std::lock_guard<std::mutex> lock(_taskMutex);
+		_task = task;
+	}
+	_taskPending = true;
+	_taskWake.notify_one();
+}
+
+// Returns once the last task started has finished, or right away if there isn't one
+void JobManager::WaitTask()
+{
+	if (!_taskPending) return;
+
+	std::unique_lock<std::mutex> lock(_taskMutex);
+	_taskDone.wait(lock, [] { return _task == nullptr; });
+	_taskPending = false;
+}
+
+bool JobManager::taskPending()
+{
+	return _taskPending;
+}
+
+// Wakes every worker and waits for them to finish before the threads are destroyed. Any task still running is finished first.
+void JobManager::DumpData()
+{
+	WaitTask();
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		std::lock_guard<std::mutex> taskLock(_taskMutex);
+		_quit = true;
+	}
+	_wake.notify_all();
+	_taskWake.notify_all();
+	if (_taskThread.joinable()) _taskThread.join();
+
+	unsigned int size = _workers.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		_workers[i].join();
+	}
+	_workers.clear();
+
+	size = _queues.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		delete _queues[i];
+	}
+	_queues.clear();
+}
+
+unsigned int JobManager::numThreads()
+{
+	return _workers.size() + 1;
+}
+
+// Workers copy the batch they are joining while holding the lock, so a worker that wakes up late never sees half of one
+// batch and half of another. If the batch has already finished there is simply nothing left for it to take.
+void JobManager::WorkerLoop(unsigned int thread)
+{
+	Profiler::NameThread("Job Worker");
+	unsigned int seen = 0;
+	while (true)
+	{
+		const RangeJob* job;
+		int count, chunkSize;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait(lock, [&] { return _quit || _generation != seen; });
+			if (_quit) return;
+			seen = _generation;
+			job = _job;
+			count = _count;
+			chunkSize = _chunkSize;
+			++_busyWorkers;
+		}
+
+		if (job) RunChunks(*job, count, chunkSize, thread);
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			--_busyWorkers;
+		}
+		_done.notify_all();
+	}
+}
+
+// Sleeps until a task is started or the job manager is shut down
+void JobManager::TaskLoop()
+{
+	Profiler::NameThread("Background Task");
+	std::unique_lock<std::mutex> lock(_taskMutex);
+	while (true)
+	{
+		_taskWake.wait(lock, [] { return _quit || _task != nullptr; });
+		if (!_task) return;
+
+		Task task = _task;
+		lock.unlock();
+		task();
+		lock.lock();
+		_task = nullptr;
+		_taskDone.notify_all();
+	}
+}
+
+// Runs the chunks in the thread's own queue, and whenever it runs dry steals more from the others. Returns once there is
+// nothing left anywhere. A thread can give up while another is between taking chunks from one queue and putting them in its
+// own, but those chunks still get run by the thread that took them.
+void JobManager::RunChunks(const RangeJob& job, int count, int chunkSize, unsigned int thread)
+{
+	ProfileZone zone("JobManager::RunChunks");
+	WorkQueue* queue = _queues[thread];
+	while (true)
+	{
+		int chunk = -1;
+		{
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			if (queue->begin < queue->end)
+			{
+				chunk = queue->begin++;
+			}
+		}
+
+		if (chunk < 0)
+		{
+			if (StealChunks(thread)) continue;
+			return;
+		}
+
+		int begin = chunk * chunkSize;
+		job(begin, std::min(begin + chunkSize, count), thread);
+	}
+}
+
+// Looks through the other threads' queues, starting with the next one along so that threads don't all pick on the same one,
+// and moves the back half of the first one with chunks left into this thread's queue. Taking half rather than one at a time
+// means a thread that has fallen behind gets to keep the front half of its work to itself.
+bool JobManager::StealChunks(unsigned int thread)
+{
+	unsigned int numQueues = _queues.size();
+	for (unsigned int i = 1; i < numQueues; ++i)
+	{
+		WorkQueue* victim = _queues[(thread + i) % numQueues];
+		int begin, end;
+		{
+			std::lock_guard<std::mutex> lock(victim->mutex);
+			if (victim->begin >= victim->end) continue;
+			end = victim->end;
+			begin = end - (end - victim->begin + 1) / 2;
+			victim->end = begin;
+		}
+
+		// Nothing else ever adds to this thread's queue, so it's still empty
+		WorkQueue* queue = _queues[thread];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		queue->begin = begin;
+		queue->end = end;
+		return true;
+	}
+	return false;
+}
@@ -1,185 +1,1226 @@
 #include "OctTreeManager.h"
 #include "InteractiveShape.h"
 #include "RenderShape.h"
-#include "RenderManager.h"
-#include <stack>
+#include "JobManager.h"
+#include "ShapeStore.h"
+#include "Profiler.h"
+#include <limits>
+#include <climits>
+#include <algorithm>
 
-std::vector<OctTreeNode*> OctTreeManager::_octTree = std::vector<OctTreeNode*>();
-std::vector<InteractiveShape*> OctTreeManager::_shapes = std::vector<InteractiveShape*>();
+// The root's key is just the start bit with an empty path below it
+static const OctTreeKey ROOT_KEY = 1;
+// Every level adds three bits to the key, so 21 levels below the root is as deep as a 64 bit key can go
+static const unsigned int MAX_KEY_DEPTH = 21;
+static const unsigned int MIN_TABLE_SIZE = 64;
+// One bit for each of the six frustum planes
+static const int ALL_PLANES = 0x3f;
+// Added to the squared distance between two masses so that shapes passing right by each other don't fling each other away
+static const float GRAVITY_SOFTENING = 0.0025f;
+// Below this many shapes it isn't worth waking the worker threads to rebuild the tree
+static const unsigned int PARALLEL_BUILD_MIN_SHAPES = 1024;
+// How many nodes the node pool makes room for at a time
+static const unsigned int NODE_BLOCK_SIZE = 512;
+// How many updates in a row the root has to be able to shrink before it does. Without it, a shape going back and forth across
+// the edge of the root's only occupied child would have the root growing and shrinking every frame.
+static const unsigned int ROOT_SHRINK_FRAMES = 60;
+
+std::vector<OctTreeManager::NodeSlot> OctTreeManager::_nodeTable = std::vector<OctTreeManager::NodeSlot>();
+std::vector<OctTreeManager::NodeSlot> OctTreeManager::_oldTable = std::vector<OctTreeManager::NodeSlot>();
+unsigned int OctTreeManager::_numNodes = 0;
+std::vector<OctTreeNode*> OctTreeManager::_freeNodes = std::vector<OctTreeNode*>();
+std::vector<OctTreeShapeBlock> OctTreeManager::_shapeBlocks = std::vector<OctTreeShapeBlock>();
+int OctTreeManager::_freeBlock = -1;
+std::vector<ShapeHandle> OctTreeManager::_splitShapes = std::vector<ShapeHandle>();
+std::vector<OctTreeNode*> OctTreeManager::_nodeList = std::vector<OctTreeNode*>();
+NodePool<OctTreeNode> OctTreeManager::_nodePool;
+NodePool<RenderShape> OctTreeManager::_outlinePool;
+std::mutex OctTreeManager::_poolMutex;
+std::vector<ShapeHandle> OctTreeManager::_shapes = std::vector<ShapeHandle>();
+std::vector<glm::vec3> OctTreeManager::_lastPositions = std::vector<glm::vec3>();
+std::vector<OctTreeKey> OctTreeManager::_shapeNodes = std::vector<OctTreeKey>();
+std::vector<InteractiveShape*> OctTreeManager::_nearbyShapes = std::vector<InteractiveShape*>();
+std::vector<OctTreeKey> OctTreeManager::_collapseCandidates = std::vector<OctTreeKey>();
+glm::vec4 OctTreeManager::_frustumPlanes[6];
+std::vector<std::pair<OctTreeKey, int>> OctTreeManager::_frustumStack = std::vector<std::pair<OctTreeKey, int>>();
+std::vector<std::pair<float, OctTreeKey>> OctTreeManager::_rayStack = std::vector<std::pair<float, OctTreeKey>>();
+std::vector<OctTreeKey> OctTreeManager::_sweepStack = std::vector<OctTreeKey>();
+float OctTreeManager::_gravityConstant = 0.0f;
+float OctTreeManager::_openingAngle = 0.5f;
+std::vector<OctTreeNode*> OctTreeManager::_nodeOrder = std::vector<OctTreeNode*>();
+std::vector<OctTreeNode*> OctTreeManager::_gravityStack = std::vector<OctTreeNode*>();
+bool OctTreeManager::_pointCloud = false;
+std::vector<std::pair<float, OctTreeNode*>> OctTreeManager::_lodHeap = std::vector<std::pair<float, OctTreeNode*>>();
+std::vector<OctTreeNode*> OctTreeManager::_lodNodes = std::vector<OctTreeNode*>();
+std::vector<ShapeHandle> OctTreeManager::_lodShapes = std::vector<ShapeHandle>();
+std::vector<ShapeHandle> OctTreeManager::_octantShapes[8];
+std::vector<OctTreeManager::BuildScratch> OctTreeManager::_buildScratch = std::vector<OctTreeManager::BuildScratch>();
+bool OctTreeManager::_unbounded = false;
+unsigned int OctTreeManager::_shrinkFrames = 0;
+TreeStats OctTreeManager::_stats;
 unsigned int OctTreeManager::_maxDepth = 0;
 unsigned int OctTreeManager::_maxPerNode = 0;
 RenderShape OctTreeManager::_outlineTemplate;
 
-// When the oct-tree manager is initialized, it instantiates the entire possible tree to avoid having to do a bunch of 
-// time wasting news and deletes during runtime.
+// Keys that differ only in their low bits belong to neighboring nodes, so they are mixed up before being used to pick a slot
+static unsigned int HashKey(OctTreeKey key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return (unsigned int)key;
+}
+
+// How many levels below the root the node a key names is, found from where its start bit sits
+static unsigned int KeyDepth(OctTreeKey key)
+{
+	unsigned int depth = 0;
+	while (key > 7)
+	{
+		key = key >> 3;
+		++depth;
+	}
+	return depth;
+}
+
+// Gives the key a node has once the root changes. With an octant, a new root has been put above the old one, which became that
+// octant, so the octant goes in at the top of the path. Without one (-1), the root's child at the top of the path has become
+// the root and its octant is taken back out.
+static OctTreeKey RekeyKey(OctTreeKey key, int octant)
+{
+	unsigned int shift = KeyDepth(key) * 3;
+	OctTreeKey path = key & ((1ULL << shift) - 1);
+	if (octant >= 0)
+	{
+		return (1ULL << (shift + 3)) | ((OctTreeKey)octant << shift) | path;
+	}
+	return (1ULL << (shift - 3)) | (path & ((1ULL << (shift - 3)) - 1));
+}
+
+// Where the center of the shape's collider is, read straight out of the shape store
+static glm::vec3 GetShapeCenter(ShapeHandle handle)
+{
+	return glm::vec3(ShapeStore::x()[handle], ShapeStore::y()[handle], ShapeStore::z()[handle]);
+}
+
+static glm::vec3 GetShapeHalfSize(ShapeHandle handle)
+{
+	return glm::vec3(ShapeStore::halfWidth()[handle], ShapeStore::halfHeight()[handle], ShapeStore::halfDepth()[handle]);
+}
+
+// The shape's box as the shape store last worked it out, which is kept up to date whenever the shape moves
+static const ShapeBox& GetShapeBox(ShapeHandle handle)
+{
+	return ShapeStore::boxes()[handle];
+}
+
+// Makes sure a vector can hold at least the given number of elements without growing. Capacity is doubled rather than grown a
+// little at a time, since this is called once for every shape that's added.
+template <typename T>
+static void ReserveAtLeast(std::vector<T>& vector, unsigned int size)
+{
+	if (vector.capacity() < size) vector.reserve(std::max(size, (unsigned int)vector.capacity() * 2));
+}
+
+// The tree only keeps handles, so they're turned back into shapes on the way out to anyone outside of it
+static void AppendShapes(const std::vector<ShapeHandle>& handles, std::vector<InteractiveShape*>& shapes)
+{
+	std::vector<InteractiveShape*>& storeShapes = ShapeStore::shapes();
+	unsigned int size = handles.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		shapes.push_back(storeShapes[handles[i]]);
+	}
+}
+
+static void AppendShapes(const OctTreeShapeRange& handles, std::vector<InteractiveShape*>& shapes)
+{
+	std::vector<InteractiveShape*>& storeShapes = ShapeStore::shapes();
+	for (OctTreeShapeRange::iterator it = handles.begin(); it != handles.end(); ++it)
+	{
+		shapes.push_back(storeShapes[*it]);
+	}
+}
+
+// Slab test between a ray and a box. The ray's direction is passed in already inverted as well since the same ray is tested
+// against many boxes. An axis the ray doesn't move along is never divided by, the ray either lies between the box's faces on
+// that axis or misses it outright. If the ray hits, entry is set to how far along the ray it enters the box, or 0 if the ray
+// starts inside of it.
+static bool RayHitsBox(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& invDirection, const glm::vec3& boxMin, const glm::vec3& boxMax, float& entry)
+{
+	float enter = -std::numeric_limits<float>::max();
+	float exit = std::numeric_limits<float>::max();
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (direction[axis] == 0.0f)
+		{
+			if (origin[axis] < boxMin[axis] || origin[axis] > boxMax[axis]) return false;
+			continue;
+		}
+
+		float t0 = (boxMin[axis] - origin[axis]) * invDirection[axis];
+		float t1 = (boxMax[axis] - origin[axis]) * invDirection[axis];
+		if (t0 > t1) std::swap(t0, t1);
+		enter = std::max(enter, t0);
+		exit = std::min(exit, t1);
+	}
+	if (exit < 0.0f || enter > exit) return false;
+	entry = enter > 0.0f ? enter : 0.0f;
+	return true;
+}
+
+// Whether two boxes touch, counting boxes that only share a face
+static bool BoxesOverlap(const glm::vec3& minA, const glm::vec3& maxA, const glm::vec3& minB, const glm::vec3& maxB)
+{
+	return minA.x <= maxB.x && maxA.x >= minB.x && minA.y <= maxB.y && maxA.y >= minB.y && minA.z <= maxB.z && maxA.z >= minB.z;
+}
+
+// Only the root is made up front. Every other node is made the first time its parent is subdivided and is stored in a hash
+// table under its key, so memory grows with the parts of space that actually hold shapes rather than with the max depth.
 void OctTreeManager::InitOctTree(float left, float right, float top, float bottom, float front, float back, unsigned int maxDepth, unsigned int maxPerNode, RenderShape outlineTemplate)
 {
 	_maxPerNode = maxPerNode;
-	_maxDepth = maxDepth;
+	_maxDepth = maxDepth > MAX_KEY_DEPTH ? MAX_KEY_DEPTH : maxDepth;
 	_outlineTemplate = outlineTemplate;
-	_octTree.resize(GetDepthIndex(maxDepth));
-	_octTree[0] = InitNode(0, 0, 0, left, right, top, bottom, front, back);
-	int maxI = GetDepthIndex(maxDepth - 1);
-	for (int i = 0; i < maxI; ++i)
+	_nodeTable.assign(MIN_TABLE_SIZE, NodeSlot());
+	_numNodes = 0;
+	_nodePool.Init(NODE_BLOCK_SIZE);
+	_outlinePool.Init(NODE_BLOCK_SIZE);
+	// Only a node above the max depth splits, and it holds at most _maxPerNode shapes when it does, so even a split at every
+	// level on the way down never sets aside more than this
+	_splitShapes.reserve(_maxPerNode * (MAX_KEY_DEPTH + 1));
+	InsertNode(InitNode(_freeNodes, ROOT_KEY, 0, left, right, top, bottom, front, back));
+}
+
+// Since most shapes don't move from one frame to the next, the tree is kept from the last update and only shapes whose positions
+// have changed are looked at. A shape that still fits in its node stays where it is. Otherwise it's taken out and walks up the
+// tree until it reaches a node that holds it entirely, and is added back into the tree from there. Nodes that have lost shapes
+// are collapsed afterwards if their children have become too empty to be worth keeping.
+void OctTreeManager::UpdateOctTree()
+{
+	ProfileZone zone("OctTreeManager::UpdateOctTree");
+	if (!FindNode(ROOT_KEY)->active)
+	{
+		RebuildOctTree();
+		return;
+	}
+
+	unsigned int shapesSize = _shapes.size();
+	for (unsigned int i = 0; i < shapesSize; ++i)
+	{
+		ShapeHandle handle = _shapes[i];
+		glm::vec3 center = GetShapeCenter(handle);
+		if (center == _lastPositions[i]) continue;
+		_lastPositions[i] = center;
+		if (_unbounded)
+		{
+			GrowRoot(handle);
+		}
+
+		OctTreeKey nodeKey = _shapeNodes[handle];
+		if (nodeKey == 0)
+		{
+			AddShape(handle, ROOT_KEY);
+			continue;
+		}
+
+		OctTreeNode* node = FindNode(nodeKey);
+		if (!node->hasChildren && (node->depth == 0 || CheckShapeNodeCollide(handle, node) == 2)) continue;
+
+		RemoveFromNode(handle, nodeKey);
+		while (node->depth != 0 && CheckShapeNodeCollide(handle, node) != 2)
+		{
+			nodeKey = nodeKey >> 3;
+			node = FindNode(nodeKey);
+		}
+		AddShape(handle, nodeKey);
+	}
+
+	CollapseUnderfull();
+	if (_unbounded)
 	{
-		InitChildren(i);
+		ShrinkRoot();
+	}
+	if (_gravityConstant != 0.0f)
+	{
+		UpdateMass();
+	}
+	if (_pointCloud)
+	{
+		UpdateLod();
 	}
 }
 
-// When updateing the tree, the manager goes through and deactivates every node in the tree and then reactivates the root.
-// It then goes through the entire array of interactive shapes and adds them back into the tree. 
-void OctTreeManager::UpdateOctTree()
+// When rebuilding the tree, the manager goes through and takes every node but the root out of the tree and then reactivates the
+// root. It then goes through the entire array of interactive shapes and adds them back into the tree, spreading the work across
+// the job manager's threads when there are enough shapes to make it worthwhile.
+void OctTreeManager::RebuildOctTree()
 {
+	ProfileZone zone("OctTreeManager::RebuildOctTree");
+	++_stats.rebuilds;
 	ResetTree();
-	ActivateNode(_octTree[0]);
+	std::fill(_shapeNodes.begin(), _shapeNodes.end(), 0);
+	_collapseCandidates.clear();
+	ActivateNode(FindNode(ROOT_KEY));
+	unsigned int shapesSize = _shapes.size();
+	for (unsigned int i = 0; i < shapesSize; ++i)
+	{
+		_lastPositions[i] = GetShapeCenter(_shapes[i]);
+		if (_unbounded)
+		{
+			GrowRoot(_shapes[i]);
+		}
+	}
+
+	if (shapesSize >= PARALLEL_BUILD_MIN_SHAPES && shapesSize > _maxPerNode && _maxDepth > 0)
+	{
+		BuildParallel();
+	}
+	else
+	{
+		for (unsigned int i = 0; i < shapesSize; ++i)
+		{
+			AddShape(_shapes[i], ROOT_KEY);
+		}
+	}
+	if (_gravityConstant != 0.0f)
+	{
+		UpdateMass();
+	}
+	if (_pointCloud)
+	{
+		UpdateLod();
+	}
+}
+
+// The root is split straight away and every shape is sorted into one of its octants in a single pass, with the shapes crossing
+// the root's center planes staying in the root. Below the root the octants have nothing in common, so each one is built on its
+// own thread out of nodes that only that thread hands out. Only once every octant is done are the new nodes put into the node
+// table and the shapes handed to their nodes, since the table and the blocks holding every node's shapes are shared.
+void OctTreeManager::BuildParallel()
+{
+	OctTreeNode* root = FindNode(ROOT_KEY);
+	ActivateChildren(root);
+	++_stats.subdivisions;
+	_stats.subdivisionShapes += _shapes.size();
+	for (int j = 0; j < 8; ++j)
+	{
+		_octantShapes[j].clear();
+	}
+	unsigned int shapesSize = _shapes.size();
+	for (unsigned int i = 0; i < shapesSize; ++i)
+	{
+		int octant = GetChildOctant(_shapes[i], root);
+		if (octant < 0)
+		{
+			PushShape(root, _shapes[i]);
+			_shapeNodes[_shapes[i]] = ROOT_KEY;
+		}
+		else
+		{
+			_octantShapes[octant].push_back(_shapes[i]);
+		}
+	}
+
+	// The free nodes are dealt out evenly so that threads rarely have to make new ones
+	unsigned int numThreads = JobManager::numThreads();
+	if (_buildScratch.size() < numThreads)
+	{
+		_buildScratch.resize(numThreads);
+	}
+	for (unsigned int i = 0; !_freeNodes.empty(); ++i)
+	{
+		_buildScratch[i % numThreads].freeNodes.push_back(_freeNodes.back());
+		_freeNodes.pop_back();
+	}
+
+	JobManager::ParallelFor(8, 1, [](int begin, int end, unsigned int thread)
+	{
+		for (int j = begin; j < end; ++j)
+		{
+			BuildOctant(j, _buildScratch[thread]);
+		}
+	});
+
+	for (unsigned int t = 0; t < numThreads; ++t)
+	{
+		BuildScratch& scratch = _buildScratch[t];
+		unsigned int size = scratch.nodes.size();
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			InsertNode(scratch.nodes[i]);
+		}
+		// Each node's shapes were placed one after another, so the node only has to be looked up once for each run of them
+		OctTreeNode* node = nullptr;
+		size = scratch.placements.size();
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			OctTreeKey nodeKey = scratch.placements[i].second;
+			if (!node || node->key != nodeKey)
+			{
+				node = FindNode(nodeKey);
+			}
+			PushShape(node, scratch.placements[i].first);
+			_shapeNodes[scratch.placements[i].first] = nodeKey;
+		}
+		_freeNodes.insert(_freeNodes.end(), scratch.freeNodes.begin(), scratch.freeNodes.end());
+		_stats.subdivisions += scratch.subdivisions;
+		_stats.subdivisionShapes += scratch.subdivisionShapes;
+		scratch.subdivisions = 0;
+		scratch.subdivisionShapes = 0;
+		scratch.nodes.clear();
+		scratch.placements.clear();
+		scratch.freeNodes.clear();
+	}
+}
+
+// Builds one of the root's octants from the top down. A node with more shapes than it can hold sorts them so that the ones
+// crossing its center planes come first, followed by the shapes for each of its children in turn. It keeps the first group
+// for itself, to be handed over once every thread is done, and each child is then filled from its own group.
+void OctTreeManager::BuildOctant(int octant, BuildScratch& scratch)
+{
+	ProfileZone zone("OctTreeManager::BuildOctant");
+	std::vector<ShapeHandle>& shapes = _octantShapes[octant];
+	scratch.stack.clear();
+	scratch.stack.push_back(BuildTask(FindNode((ROOT_KEY << 3) | octant), 0, shapes.size()));
+	while (!scratch.stack.empty())
+	{
+		BuildTask task = scratch.stack.back();
+		scratch.stack.pop_back();
+		OctTreeNode* node = task.node;
+		int count = task.end - task.begin;
+
+		int groupSizes[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+		if (count > (int)_maxPerNode && node->depth < _maxDepth)
+		{
+			scratch.octants.resize(count);
+			for (int i = 0; i < count; ++i)
+			{
+				scratch.octants[i] = GetChildOctant(shapes[task.begin + i], node) + 1;
+				++groupSizes[scratch.octants[i]];
+			}
+		}
+		else
+		{
+			groupSizes[0] = count;
+		}
+
+		if (groupSizes[0] < count)
+		{
+			int groupStarts[9];
+			groupStarts[0] = 0;
+			for (int j = 1; j < 9; ++j)
+			{
+				groupStarts[j] = groupStarts[j - 1] + groupSizes[j - 1];
+			}
+			scratch.sorted.resize(count);
+			for (int i = 0; i < count; ++i)
+			{
+				scratch.sorted[groupStarts[scratch.octants[i]]++] = shapes[task.begin + i];
+			}
+			std::copy(scratch.sorted.begin(), scratch.sorted.end(), shapes.begin() + task.begin);
+
+			OctTreeNode* children[8];
+			InitChildren(node, scratch.freeNodes, children);
+			++scratch.subdivisions;
+			scratch.subdivisionShapes += count;
+			int childBegin = task.begin + groupSizes[0];
+			for (int j = 0; j < 8; ++j)
+			{
+				scratch.nodes.push_back(children[j]);
+				scratch.stack.push_back(BuildTask(children[j], childBegin, childBegin + groupSizes[j + 1]));
+				childBegin += groupSizes[j + 1];
+			}
+		}
+
+		for (int i = 0; i < groupSizes[0]; ++i)
+		{
+			scratch.placements.push_back(std::make_pair(shapes[task.begin + i], node->key));
+		}
+	}
+}
+
+// Shapes are added to the tree on the next update. Room is made straight away for what updates and queries can need for the
+// new shape, so they never have to grow anything themselves. Every block but a node's last is full and a block only ever holds
+// one node's shapes, so there are never more blocks in use than shapes. Moving a child's shapes up into its parent takes the
+// parent's new blocks before the child's are freed, which can need up to an eighth as many again.
+void OctTreeManager::AddShape(InteractiveShape* shape)
+{
+	ShapeHandle handle = shape->handle();
+	_shapes.push_back(handle);
+	unsigned int numShapes = _shapes.size();
+	ReserveAtLeast(_shapeBlocks, numShapes + numShapes / OctTreeShapeBlock::SIZE + 1);
+	ReserveAtLeast(_collapseCandidates, numShapes);
+	ReserveAtLeast(_nearbyShapes, numShapes);
+	ReserveAtLeast(_lodShapes, numShapes);
+	_lastPositions.push_back(glm::vec3(std::numeric_limits<float>::quiet_NaN()));
+	if (handle >= _shapeNodes.size())
+	{
+		_shapeNodes.resize(handle + 1, 0);
+	}
+}
+
+// When the program ends, every node of the oct-tree that it instantiated goes along with its outline, both the ones in the
+// tree and the ones waiting to be reused. They all came out of the pools, so the pools are simply emptied.
+void OctTreeManager::DumpData()
+{
+	_nodeTable.clear();
+	_numNodes = 0;
+	_freeNodes.clear();
+	_shapeBlocks.clear();
+	_freeBlock = -1;
+
+	_nodePool.Clear();
+	_outlinePool.Clear();
+}
+
+// Retrieves all the shapes that share a node with the shape passed in. It uses a method similar to when a shape is being
+// added to the tree. When it gets to the lowest node that the argument shape fits entirely inside of, it returns the shapes
+// associated with that node. The list is only good until the next call.
+const std::vector<InteractiveShape*>& OctTreeManager::GetNearbyShapes(InteractiveShape* shape)
+{
+	ShapeHandle handle = shape->handle();
+	OctTreeNode* currentNode = FindNode(ROOT_KEY);
+	while (currentNode->hasChildren)
+	{
+		int octant = GetChildOctant(handle, currentNode);
+		// The shape crosses one of the planes splitting this node, so this is as far down as it goes
+		if (octant < 0)
+		{
+			break;
+		}
+		currentNode = FindNode((currentNode->key << 3) | octant);
+	}
+	++_stats.nearbyQueries;
+	_stats.nearbyCandidates += currentNode->numShapes;
+	_nearbyShapes.clear();
+	AppendShapes(GetShapes(currentNode), _nearbyShapes);
+	return _nearbyShapes;
+}
+
+// Finds everything inside the view frustum described by the matrix. Each node is only tested against the frustum planes that
+// its parent crossed, so once a node is found to be entirely inside, its whole subtree is handed back without testing anything
+// else. Shapes are only tested one at a time in nodes that cross the edge of the frustum.
+void OctTreeManager::GetVisibleShapes(const glm::mat4& viewProjMat, std::vector<InteractiveShape*>& shapes, std::vector<RenderShape*>& outlines)
+{
+	ProfileZone zone("OctTreeManager::GetVisibleShapes");
+	shapes.clear();
+	outlines.clear();
+	if (!FindNode(ROOT_KEY)->active) return;
+
+	// Each pair of planes is the last row of the matrix plus and minus one of the other rows
+	glm::vec4 rowW = glm::vec4(viewProjMat[0][3], viewProjMat[1][3], viewProjMat[2][3], viewProjMat[3][3]);
+	for (int i = 0; i < 3; ++i)
+	{
+		glm::vec4 row = glm::vec4(viewProjMat[0][i], viewProjMat[1][i], viewProjMat[2][i], viewProjMat[3][i]);
+		_frustumPlanes[i * 2] = rowW + row;
+		_frustumPlanes[i * 2 + 1] = rowW - row;
+	}
+
+	_frustumStack.clear();
+	_frustumStack.push_back(std::make_pair(ROOT_KEY, ALL_PLANES));
+	while (!_frustumStack.empty())
+	{
+		OctTreeKey nodeKey = _frustumStack.back().first;
+		int planeMask = _frustumStack.back().second;
+		_frustumStack.pop_back();
+
+		OctTreeNode* node = FindNode(nodeKey);
+		if (planeMask != 0 && !ClassifyBox(glm::vec3(node->left, node->bottom, node->back), glm::vec3(node->right, node->top, node->front), planeMask))
+		{
+			continue;
+		}
+
+		outlines.push_back(node->outline);
+		if (planeMask == 0)
+		{
+			AppendShapes(GetShapes(node), shapes);
+		}
+		else
+		{
+			OctTreeShapeRange nodeShapes = GetShapes(node);
+			for (OctTreeShapeRange::iterator it = nodeShapes.begin(); it != nodeShapes.end(); ++it)
+			{
+				const ShapeBox& box = GetShapeBox(*it);
+				int shapeMask = planeMask;
+				if (ClassifyBox(box.min, box.max, shapeMask))
+				{
+					shapes.push_back(ShapeStore::shapes()[*it]);
+				}
+			}
+		}
+
+		if (node->hasChildren)
+		{
+			for (int j = 0; j < 8; ++j)
+			{
+				_frustumStack.push_back(std::make_pair((nodeKey << 3) | j, planeMask));
+			}
+		}
+	}
+}
+
+// Finds the closest shape that the ray hits. Nodes are opened nearest first, and a node is skipped if the ray only gets to it
+// after the closest hit found so far, so only the nodes close to the ray's path before the hit are ever looked at. The root is
+// always opened since shapes that have wandered outside of its bounds are stored there. If hitDistance is given it is set to how
+// far along the ray the hit is, measured in lengths of the direction vector.
+InteractiveShape* OctTreeManager::RaycastShapes(const glm::vec3& origin, const glm::vec3& direction, float* hitDistance)
+{
+	if (!FindNode(ROOT_KEY)->active) return nullptr;
+
+	glm::vec3 invDirection = glm::vec3(1.0f, 1.0f, 1.0f) / direction;
+	ShapeHandle closest = 0;
+	bool hit = false;
+	float closestDistance = std::numeric_limits<float>::max();
+
+	_rayStack.clear();
+	_rayStack.push_back(std::make_pair(0.0f, ROOT_KEY));
+	while (!_rayStack.empty())
+	{
+		float nodeEntry = _rayStack.back().first;
+		OctTreeKey nodeKey = _rayStack.back().second;
+		_rayStack.pop_back();
+		if (nodeEntry >= closestDistance) continue;
+
+		OctTreeNode* node = FindNode(nodeKey);
+		OctTreeShapeRange nodeShapes = GetShapes(node);
+		for (OctTreeShapeRange::iterator it = nodeShapes.begin(); it != nodeShapes.end(); ++it)
+		{
+			const ShapeBox& box = GetShapeBox(*it);
+			float entry;
+			if (RayHitsBox(origin, direction, invDirection, box.min, box.max, entry) && entry < closestDistance)
+			{
+				closest = *it;
+				closestDistance = entry;
+				hit = true;
+			}
+		}
+
+		if (!node->hasChildren) continue;
+
+		// Sort the children the ray passes through from furthest to nearest, so the nearest ends up on top of the stack
+		std::pair<float, OctTreeKey> children[8];
+		int numChildren = 0;
+		for (int j = 0; j < 8; ++j)
+		{
+			OctTreeKey childKey = (nodeKey << 3) | j;
+			OctTreeNode* child = FindNode(childKey);
+			float entry;
+			if (!RayHitsBox(origin, direction, invDirection, glm::vec3(child->left, child->bottom, child->back), glm::vec3(child->right, child->top, child->front), entry) || entry >= closestDistance)
+			{
+				continue;
+			}
+
+			int k = numChildren++;
+			while (k > 0 && children[k - 1].first < entry)
+			{
+				children[k] = children[k - 1];
+				--k;
+			}
+			children[k] = std::make_pair(entry, childKey);
+		}
+		_rayStack.insert(_rayStack.end(), children, children + numChildren);
+	}
+
+	if (!hit) return nullptr;
+	if (hitDistance)
+	{
+		*hitDistance = closestDistance;
+	}
+	return ShapeStore::shapes()[closest];
+}
+
+// Finds every shape that the given shape would run into while moving from its start position to its end position, ordered by
+// when it would first touch them as a fraction of the way from start to end. Sweeping one box against another is the same as
+// casting a ray from the moving box's center against the other box grown by the moving box's half size, so both the shapes and
+// the nodes holding them are tested that way, with anything touched later than the end of the move left out. A move of no
+// length is just the shape's box at its start, so it finds every shape that box touches, all at 0. The root is always opened
+// since shapes that have wandered outside of its bounds are stored there.
+void OctTreeManager::GetSweptShapes(InteractiveShape* shape, const glm::vec3& start, const glm::vec3& end, std::vector<std::pair<float, InteractiveShape*>>& hits)
+{
+	hits.clear();
+	if (!FindNode(ROOT_KEY)->active) return;
+
+	ShapeHandle handle = shape->handle();
+	glm::vec3 halfSize = GetShapeHalfSize(handle);
+	glm::vec3 offset = GetShapeCenter(handle) - shape->position();
+	glm::vec3 origin = start + offset;
+	glm::vec3 direction = end - start;
+	glm::vec3 invDirection = glm::vec3(1.0f, 1.0f, 1.0f) / direction;
+	bool still = direction == glm::vec3(0.0f);
+
+	_sweepStack.clear();
+	_sweepStack.push_back(ROOT_KEY);
+	while (!_sweepStack.empty())
+	{
+		OctTreeKey nodeKey = _sweepStack.back();
+		_sweepStack.pop_back();
+		OctTreeNode* node = FindNode(nodeKey);
+
+		OctTreeShapeRange nodeShapes = GetShapes(node);
+		for (OctTreeShapeRange::iterator it = nodeShapes.begin(); it != nodeShapes.end(); ++it)
+		{
+			if (*it == handle) continue;
+			const ShapeBox& other = GetShapeBox(*it);
+			float entry = 0.0f;
+			if (still ? BoxesOverlap(origin - halfSize, origin + halfSize, other.min, other.max) :
+				RayHitsBox(origin, direction, invDirection, other.min - halfSize, other.max + halfSize, entry) && entry <= 1.0f)
+			{
+				hits.push_back(std::make_pair(entry, ShapeStore::shapes()[*it]));
+			}
+		}
+
+		if (!node->hasChildren) continue;
+		for (int j = 0; j < 8; ++j)
+		{
+			OctTreeKey childKey = (nodeKey << 3) | j;
+			OctTreeNode* child = FindNode(childKey);
+			glm::vec3 childMin = glm::vec3(child->left, child->bottom, child->back);
+			glm::vec3 childMax = glm::vec3(child->right, child->top, child->front);
+			float entry;
+			if (still ? BoxesOverlap(origin - halfSize, origin + halfSize, childMin, childMax) :
+				RayHitsBox(origin, direction, invDirection, childMin - halfSize, childMax + halfSize, entry) && entry <= 1.0f)
+			{
+				_sweepStack.push_back(childKey);
+			}
+		}
+	}
+
+	std::sort(hits.begin(), hits.end());
+}
+
+// Sweeps the shape from where it is now to where its velocity will take it over the time step
+void OctTreeManager::GetSweptShapes(InteractiveShape* shape, float dt, std::vector<std::pair<float, InteractiveShape*>>& hits)
+{
+	glm::vec3 start = shape->position();
+	GetSweptShapes(shape, start, start + shape->velocity() * dt, hits);
+}
+
+// Turns on gravity between the shapes, or turns it off if the constant is 0. A smaller opening angle opens up more nodes
+// instead of treating them as a single mass, which is slower but more accurate. At 0 every pair of shapes is looked at.
+void OctTreeManager::SetGravity(float gravityConstant, float openingAngle)
+{
+	_gravityConstant = gravityConstant;
+	_openingAngle = openingAngle;
+	if (_gravityConstant != 0.0f && FindNode(ROOT_KEY)->active)
+	{
+		UpdateMass();
+	}
+}
+
+// Speeds every shape up by the pull of all the others over the time step. It should be called after the tree is updated and
+// before the shapes are, so that the shapes' own updates carry the new velocities into their positions.
+void OctTreeManager::ApplyGravity(float dt)
+{
+	ProfileZone zone("OctTreeManager::ApplyGravity");
+	if (_gravityConstant == 0.0f || !FindNode(ROOT_KEY)->active) return;
+
+	std::vector<float>& velocityX = ShapeStore::velocityX();
+	std::vector<float>& velocityY = ShapeStore::velocityY();
+	std::vector<float>& velocityZ = ShapeStore::velocityZ();
 	unsigned int shapesSize = _shapes.size();
 	for (unsigned int i = 0; i < shapesSize; ++i)
 	{
-		AddShape(_shapes[i], 0);
+		ShapeHandle handle = _shapes[i];
+		glm::vec3 change = GetGravity(handle) * dt;
+		velocityX[handle] += change.x;
+		velocityY[handle] += change.y;
+		velocityZ[handle] += change.z;
+	}
+}
+
+float OctTreeManager::gravityConstant()
+{
+	return _gravityConstant;
+}
+
+// The bounds given to InitOctTree become the starting size of the root. Shapes already outside of it were left in the root when
+// they were added, so the tree is rebuilt to grow the root around them.
+void OctTreeManager::SetUnbounded(bool unbounded)
+{
+	_unbounded = unbounded;
+	_shrinkFrames = 0;
+	if (_unbounded && FindNode(ROOT_KEY)->active)
+	{
+		RebuildOctTree();
+	}
+}
+
+bool OctTreeManager::unbounded()
+{
+	return _unbounded;
+}
+
+void OctTreeManager::SetPointCloud(bool pointCloud)
+{
+	_pointCloud = pointCloud;
+	if (_pointCloud && FindNode(ROOT_KEY)->active)
+	{
+		UpdateLod();
+	}
+}
+
+bool OctTreeManager::pointCloud()
+{
+	return _pointCloud;
+}
+
+// How many nodes the tree would have with every node split down to the deepest level it allows right now. A tree that grows
+// gets deeper, so this can go up after the tree is first made.
+unsigned int OctTreeManager::maxNodes()
+{
+	unsigned long long total = 0;
+	unsigned long long level = 1;
+	for (unsigned int depth = 0; depth <= _maxDepth && total < UINT_MAX; ++depth)
+	{
+		total += level;
+		level *= 8;
+	}
+	return total < UINT_MAX ? (unsigned int)total : UINT_MAX;
+}
+
+// Makes every node the tree can have at its current max depth up front, along with room for all of them in the node table and
+// in the lists that go through the nodes, so that updates never have to grow any of these when the tree holds more nodes than
+// it has before. This gives up only using memory for the parts of space that hold shapes, so it's only worth doing when every
+// allocation counts. A root growing while unbounded adds levels, and the nodes for those are still made as they're needed.
+void OctTreeManager::ReserveNodes()
+{
+	unsigned int count = maxNodes();
+	_freeNodes.reserve(count);
+	for (unsigned int made = _numNodes + _freeNodes.size(); made < count; ++made)
+	{
+		_freeNodes.push_back(MakeNode());
+	}
+	while (count * 2 > _nodeTable.size())
+	{
+		GrowTable();
+	}
+	_nodeList.reserve(count);
+	_frustumStack.reserve(count);
+	_rayStack.reserve(count);
+	_sweepStack.reserve(count);
+	_nodeOrder.reserve(count);
+	_gravityStack.reserve(count);
+	_lodHeap.reserve(count);
+	_lodNodes.reserve(count);
+}
+
+// Hands back at most maxShapes shapes standing in for all of them, picked from the samples of the nodes that SelectLod leaves
+// unopened and the shapes stored in the ones it opens. Any budget above zero gets something back: one smaller than the root's
+// own samples, up to OctTreeNode::MAX_SAMPLES, gets that many of the root's samples spread evenly across them. Only works in
+// point cloud mode.
+void OctTreeManager::GetLodShapes(const glm::vec3& eye, unsigned int maxShapes, std::vector<InteractiveShape*>& shapes)
+{
+	shapes.clear();
+	if (!_pointCloud) return;
+
+	SelectLod(eye, maxShapes, true);
+	AppendShapes(_lodShapes, shapes);
+	unsigned int size = _lodNodes.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		OctTreeNode* node = _lodNodes[i];
+		if (node->numSamples <= maxShapes)
+		{
+			for (unsigned int k = 0; k < node->numSamples; ++k)
+			{
+				shapes.push_back(ShapeStore::shapes()[node->samples[k]]);
+			}
+			continue;
+		}
+		// Only the root can be left over budget, and only when it's the one node left unopened
+		for (unsigned int k = 0; k < maxShapes; ++k)
+		{
+			shapes.push_back(ShapeStore::shapes()[node->samples[(k * node->numSamples) / maxShapes]]);
+		}
+	}
+}
+
+// Hands back at most maxPoints points standing in for all of the shapes. Every node SelectLod leaves unopened becomes a single
+// point at the average position and color of its shapes, and the shapes stored in the nodes it opens are points of their own.
+// Only works in point cloud mode.
+void OctTreeManager::GetLodPoints(const glm::vec3& eye, unsigned int maxPoints, std::vector<OctTreeLodPoint>& points)
+{
+	points.clear();
+	if (!_pointCloud) return;
+
+	SelectLod(eye, maxPoints, false);
+	OctTreeLodPoint point;
+	unsigned int size = _lodShapes.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		point.position = GetShapeCenter(_lodShapes[i]);
+		point.color = ShapeStore::shapes()[_lodShapes[i]]->color();
+		point.count = 1;
+		points.push_back(point);
+	}
+	size = _lodNodes.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		point.position = _lodNodes[i]->centroid;
+		point.color = _lodNodes[i]->color;
+		point.count = _lodNodes[i]->count;
+		points.push_back(point);
+	}
+}
+
+// Fills in the stats from the running counts and every node in the node table. Shapes that cross a node's center planes are kept
+// in the node itself, so any shapes held by a node with children are straddling shapes. Splits made while building the tree count
+// as subdivisions along with those made as shapes move. This reads the tree, so it mustn't be called while an update is running.
+void OctTreeManager::GetStats(TreeStats& stats)
+{
+	stats = _stats;
+	stats.ClearNodes();
+	unsigned int tableSize = _nodeTable.size();
+	for (unsigned int i = 0; i < tableSize; ++i)
+	{
+		OctTreeNode* node = _nodeTable[i].node;
+		if (!node || !node->active) continue;
+		stats.CountNode(node->depth, node->numShapes);
+		if (node->hasChildren) stats.straddlingShapes += node->numShapes;
+	}
+}
+
+void OctTreeManager::ResetStats()
+{
+	_stats.Reset();
+}
+
+// Lists every node in the tree with parents before their children. Going through the list backwards finishes every child
+// before its parent needs it.
+void OctTreeManager::OrderNodes()
+{
+	_nodeOrder.clear();
+	_nodeOrder.push_back(FindNode(ROOT_KEY));
+	for (unsigned int i = 0; i < _nodeOrder.size(); ++i)
+	{
+		OctTreeNode* node = _nodeOrder[i];
+		if (node->hasChildren)
+		{
+			for (int j = 0; j < 8; ++j)
+			{
+				_nodeOrder.push_back(FindNode((node->key << 3) | j));
+			}
+		}
+	}
+}
+
+// Adds up the mass and center of mass of every node from the bottom of the tree upwards
+void OctTreeManager::UpdateMass()
+{
+	ProfileZone zone("OctTreeManager::UpdateMass");
+	OrderNodes();
+	std::vector<float>& shapeMass = ShapeStore::mass();
+	for (int i = _nodeOrder.size() - 1; i >= 0; --i)
+	{
+		OctTreeNode* node = _nodeOrder[i];
+		glm::vec3 weightedSum = glm::vec3();
+		float mass = 0.0f;
+		OctTreeShapeRange nodeShapes = GetShapes(node);
+		for (OctTreeShapeRange::iterator it = nodeShapes.begin(); it != nodeShapes.end(); ++it)
+		{
+			weightedSum += GetShapeCenter(*it) * shapeMass[*it];
+			mass += shapeMass[*it];
+		}
+		if (node->hasChildren)
+		{
+			for (int j = 0; j < 8; ++j)
+			{
+				OctTreeNode* child = FindNode((node->key << 3) | j);
+				weightedSum += child->centerOfMass * child->mass;
+				mass += child->mass;
+			}
+		}
+		node->mass = mass;
+		node->centerOfMass = mass > 0.0f ? weightedSum / mass : (glm::vec3(node->left + node->right, node->top + node->bottom, node->front + node->back) / 2.0f);
+	}
+}
+
+// Works out every node's samples, shape count and average position and color from the bottom of the tree upwards. The node's
+// own shapes and each of its children are sources for its samples, and each source gets a share of the samples that matches its
+// share of the shapes, rounded down. Samples left over from the rounding go to the first sources that still have some to give.
+// Within a source the samples are taken evenly spaced, so a node's samples spread out across everything below it.
+void OctTreeManager::UpdateLod()
+{
+	ProfileZone zone("OctTreeManager::UpdateLod");
+	OrderNodes();
+	for (int i = _nodeOrder.size() - 1; i >= 0; --i)
+	{
+		OctTreeNode* node = _nodeOrder[i];
+		OctTreeNode* children[8];
+		OctTreeShapeRange nodeShapes = GetShapes(node);
+		unsigned int ownSize = nodeShapes.size();
+		unsigned int count = ownSize;
+		glm::vec3 positionSum = glm::vec3();
+		glm::vec4 colorSum = glm::vec4();
+		for (OctTreeShapeRange::iterator it = nodeShapes.begin(); it != nodeShapes.end(); ++it)
+		{
+			positionSum += GetShapeCenter(*it);
+			colorSum += ShapeStore::shapes()[*it]->color();
+		}
+		if (node->hasChildren)
+		{
+			for (int j = 0; j < 8; ++j)
+			{
+				children[j] = FindNode((node->key << 3) | j);
+				count += children[j]->count;
+				positionSum += children[j]->centroid * (float)children[j]->count;
+				colorSum += children[j]->color * (float)children[j]->count;
+			}
+		}
+		node->count = count;
+		node->centroid = count > 0 ? positionSum / (float)count : glm::vec3();
+		node->color = count > 0 ? colorSum / (float)count : glm::vec4();
+
+		// Source 0 is the node's own shapes and sources 1 to 8 are its children
+		int numSources = node->hasChildren ? 9 : 1;
+		unsigned int quotas[9];
+		unsigned int given = 0;
+		for (int j = 0; j < numSources; ++j)
+		{
+			unsigned int sourceCount = j == 0 ? ownSize : children[j - 1]->count;
+			quotas[j] = count > 0 ? (sourceCount * OctTreeNode::MAX_SAMPLES) / count : 0;
+			given += quotas[j];
+		}
+		for (int j = 0; j < numSources && given < OctTreeNode::MAX_SAMPLES; ++j)
+		{
+			unsigned int available = j == 0 ? ownSize : children[j - 1]->numSamples;
+			if (quotas[j] < available)
+			{
+				++quotas[j];
+				++given;
+			}
+		}
+
+		// The node's own shapes can only be walked forwards through its blocks, which is all that evenly spaced samples need
+		node->numSamples = 0;
+		unsigned int ownQuota = quotas[0] < ownSize ? quotas[0] : ownSize;
+		OctTreeShapeRange::iterator own = nodeShapes.begin();
+		unsigned int ownIndex = 0;
+		for (unsigned int k = 0; k < ownQuota; ++k)
+		{
+			for (unsigned int target = (k * ownSize) / ownQuota; ownIndex < target; ++ownIndex)
+			{
+				++own;
+			}
+			node->samples[node->numSamples++] = *own;
+		}
+		for (int j = 1; j < numSources; ++j)
+		{
+			unsigned int available = children[j - 1]->numSamples;
+			unsigned int quota = quotas[j] < available ? quotas[j] : available;
+			for (unsigned int k = 0; k < quota; ++k)
+			{
+				node->samples[node->numSamples++] = children[j - 1]->samples[(k * available) / quota];
+			}
+		}
 	}
 }
 
-void OctTreeManager::AddShape(InteractiveShape* shape)
+// Picks which nodes make up a level of detail approximation for a viewer at the eye. Starting from the root standing in for
+// everything, the node that looks largest from the eye, its width over its distance, is opened next: it's replaced by the shapes
+// stored in it and its children that hold anything. A node is only opened if what replaces it still fits within the budget, so
+// the approximation gets finer wherever the viewer is closest without ever going over. Each unopened node costs its number of
+// samples, or a single point when not using samples. The unopened nodes end up in _lodNodes and the opened nodes' shapes in
+// _lodShapes. A budget too small for even the root's samples leaves the root unopened on its own, and it's up to the caller to
+// take only as many of its samples as the budget allows.
+void OctTreeManager::SelectLod(const glm::vec3& eye, unsigned int budget, bool samples)
 {
-	_shapes.push_back(shape);
-}
+	_lodHeap.clear();
+	_lodNodes.clear();
+	_lodShapes.clear();
+	OctTreeNode* root = FindNode(ROOT_KEY);
+	if (!root->active || root->count == 0) return;
 
-// When the program ends, the manager has to go through and delete all of the nodes of quad tree that it instantiated
-// during the init function.
-void OctTreeManager::DumpData()
-{
-	int i;
-	while ((i = _octTree.size()) > 0)
+	unsigned int used = samples ? root->numSamples : 1;
+	if (budget == 0) return;
+	if (used > budget)
 	{
-		delete _octTree[i - 1];
-		_octTree.pop_back();
+		_lodNodes.push_back(root);
+		return;
 	}
-}
-
-// Retrieves all the shapes that share a node with the shape passed in. It uses a method similar to when a shape is being
-// added to the tree. When it gets to the lowest node that the argument shape collides with, it returns the array of shapes
-// associated with that node.
-const std::vector<InteractiveShape*>& OctTreeManager::GetNearbyShapes(InteractiveShape* shape)
-{
-	unsigned int treeSize = _octTree.size();
-	for (unsigned int i = 0; i < treeSize;)
+	_lodHeap.push_back(std::make_pair(0.0f, root));
+	while (!_lodHeap.empty())
 	{
-		OctTreeNode* currentNode = _octTree[i];
-		int result = CheckShapeNodeCollide(shape, currentNode);
-		// No collision
-		if (result == 0)
-		{
-			++i;
-			continue;
-		}
-		// Partial collision
-		if (result == 1)
+		std::pop_heap(_lodHeap.begin(), _lodHeap.end());
+		OctTreeNode* node = _lodHeap.back().second;
+		_lodHeap.pop_back();
+
+		unsigned int cost = samples ? node->numSamples : 1;
+		unsigned int opened = node->numShapes;
+		OctTreeNode* children[8];
+		if (node->hasChildren)
 		{
-			if (currentNode->depth != 0)
-			{
-				return _octTree[currentNode->parent]->shapes;
-			}
-			else
+			for (int j = 0; j < 8; ++j)
 			{
-				result = 2;
+				children[j] = FindNode((node->key << 3) | j);
+				if (children[j]->count > 0)
+				{
+					opened += samples ? children[j]->numSamples : 1;
+				}
 			}
-
 		}
-		// Full collision
-		if (result == 2)
+		if (used - cost + opened > budget)
 		{
+			_lodNodes.push_back(node);
+			continue;
+		}
 
-			if (!currentNode->hasChildren)
-			{
-				return currentNode->shapes;
-			}
-			else
-			{
-				i = currentNode->children[0];
-			}
+		used = used - cost + opened;
+		OctTreeShapeRange nodeShapes = GetShapes(node);
+		for (OctTreeShapeRange::iterator it = nodeShapes.begin(); it != nodeShapes.end(); ++it)
+		{
+			_lodShapes.push_back(*it);
+		}
+		if (!node->hasChildren) continue;
+		for (int j = 0; j < 8; ++j)
+		{
+			if (children[j]->count == 0) continue;
+			glm::vec3 center = glm::vec3(children[j]->left + children[j]->right, children[j]->top + children[j]->bottom, children[j]->front + children[j]->back) / 2.0f;
+			float distance = glm::length(center - eye);
+			float size = (children[j]->right - children[j]->left) / (distance > 0.0f ? distance : std::numeric_limits<float>::min());
+			_lodHeap.push_back(std::make_pair(size, children[j]));
+			std::push_heap(_lodHeap.begin(), _lodHeap.end());
 		}
 	}
 }
 
-// Adds the given shape to the oct-tree beginnng at the node index passed in. Shapes are added to the first node that with which they have a successful collision
-// If they only have a partial collision, they are added to that node's parent. If a node is at the bottom of the activated tree, and it exceeds the max number
-// of shapes, then each of it's shapes are added back into the tree, passing that node's index as the starting node and that node's children are activated.
-void OctTreeManager::AddShape(InteractiveShape* shape, int startingNode)
+// Barnes-Hut approximation of the pull on a shape from every other shape. A node that looks small enough from the shape, its
+// width over its distance being under the opening angle, pulls as a single mass at its center of mass. Otherwise the shapes
+// stored in the node pull on their own and its children are looked at in turn.
+glm::vec3 OctTreeManager::GetGravity(ShapeHandle handle)
 {
-	unsigned int treeSize = _octTree.size();
-	for (unsigned int i = startingNode; i < treeSize;)
+	glm::vec3 position = GetShapeCenter(handle);
+	std::vector<float>& shapeMass = ShapeStore::mass();
+	glm::vec3 acceleration = glm::vec3();
+	float openingAngleSq = _openingAngle * _openingAngle;
+
+	_gravityStack.clear();
+	_gravityStack.push_back(FindNode(ROOT_KEY));
+	while (!_gravityStack.empty())
 	{
-		OctTreeNode* currentNode = _octTree[i];
-		int result = CheckShapeNodeCollide(shape, currentNode);
-		// No collision
-		if (result == 0)
+		OctTreeNode* node = _gravityStack.back();
+		_gravityStack.pop_back();
+		if (node->mass == 0.0f) continue;
+
+		glm::vec3 offset = node->centerOfMass - position;
+		float distanceSq = glm::dot(offset, offset);
+		float width = glm::max(glm::max(node->right - node->left, node->top - node->bottom), node->front - node->back);
+		if (node->hasChildren && width * width < openingAngleSq * distanceSq)
 		{
-			++i;
+			float softenedSq = distanceSq + GRAVITY_SOFTENING;
+			acceleration += offset * (node->mass / (softenedSq * sqrtf(softenedSq)));
 			continue;
 		}
-		// Partial collision
-		if (result == 1)
+
+		OctTreeShapeRange nodeShapes = GetShapes(node);
+		for (OctTreeShapeRange::iterator it = nodeShapes.begin(); it != nodeShapes.end(); ++it)
+		{
+			if (*it == handle) continue;
+			glm::vec3 shapeOffset = GetShapeCenter(*it) - position;
+			float softenedSq = glm::dot(shapeOffset, shapeOffset) + GRAVITY_SOFTENING;
+			acceleration += shapeOffset * (shapeMass[*it] / (softenedSq * sqrtf(softenedSq)));
+		}
+		if (node->hasChildren)
 		{
-			if (currentNode->depth != 0)
+			for (int j = 0; j < 8; ++j)
 			{
-				_octTree[currentNode->parent]->shapes.push_back(shape);
-				break;
+				_gravityStack.push_back(FindNode((node->key << 3) | j));
 			}
-			else
+		}
+	}
+	return acceleration * _gravityConstant;
+}
+
+// Adds the given shape to the oct-tree beginnng at the node passed in. At each node the child holding the shape is worked
+// out straight from the node's center, and shapes that cross the center planes are kept in the node itself. If a node is at the
+// bottom of the activated tree, and it exceeds the max number of shapes, then that node's children are activated and each of its
+// shapes are added back into the tree, passing that node as the starting node.
+void OctTreeManager::AddShape(ShapeHandle handle, OctTreeKey startingNode)
+{
+	OctTreeKey nodeKey = startingNode;
+	while (true)
+	{
+		OctTreeNode* currentNode = FindNode(nodeKey);
+		if (!currentNode->hasChildren)
+		{
+			if (currentNode->numShapes < _maxPerNode || currentNode->depth >= _maxDepth)
 			{
-				result = 2;
+				PushShape(currentNode, handle);
+				_shapeNodes[handle] = nodeKey;
+				return;
 			}
 
-		}
-		// Full collision
-		if (result == 2)
-		{
-			if (currentNode->shapes.size() >= _maxPerNode  && currentNode->depth < _maxDepth)
+			ActivateChildren(currentNode);
+			// Add all the shapes in the current node to the current node's children. They're set aside at the end of the split
+			// list first, and a split further down adds its own shapes after these and takes them off again before it returns.
+			unsigned int first = _splitShapes.size();
+			++_stats.subdivisions;
+			_stats.subdivisionShapes += currentNode->numShapes;
+			OctTreeShapeRange nodeShapes = GetShapes(currentNode);
+			for (OctTreeShapeRange::iterator it = nodeShapes.begin(); it != nodeShapes.end(); ++it)
 			{
-				if (!currentNode->hasChildren)
-				{
-					ActivateChildren(currentNode);
-					// Add all the shapes in the current node to the current node's children
-					std::vector<InteractiveShape*> shapesTemp = currentNode->shapes;
-					currentNode->shapes.clear();
-					unsigned int size = shapesTemp.size();
-					for (unsigned int j = 0; j < size; ++j)
-					{
-						AddShape(shapesTemp[j], currentNode->children[0]);
-					}
-				}
-				i = currentNode->children[0];
+				_splitShapes.push_back(*it);
 			}
-			else
+			ClearShapes(currentNode);
+			unsigned int size = _splitShapes.size();
+			for (unsigned int j = first; j < size; ++j)
 			{
-				if (!currentNode->hasChildren)
-				{
-					currentNode->shapes.push_back(shape);
-					break;
-				}
-				else
-				{
-					i = currentNode->children[0];
-				}
+				AddShape(_splitShapes[j], nodeKey);
 			}
+			_splitShapes.resize(first);
+		}
+
+		int octant = GetChildOctant(handle, currentNode);
+		if (octant < 0)
+		{
+			PushShape(currentNode, handle);
+			_shapeNodes[handle] = nodeKey;
+			return;
 		}
+		nodeKey = (nodeKey << 3) | octant;
 	}
 }
 
+// Works out which of the node's children the shape belongs in by comparing it against the node's center on each axis. The
+// children are numbered the same way ActivateChildren lays them out: +1 for the right half, +2 for the bottom half and +4 for
+// the back half. Returns -1 if the shape crosses any of the center planes, since then no single child holds all of it.
+int OctTreeManager::GetChildOctant(ShapeHandle handle, OctTreeNode* node)
+{
+	const ShapeBox& box = GetShapeBox(handle);
+	float midX = node->left + ((node->right - node->left) / 2.0f);
+	float midY = node->bottom + ((node->top - node->bottom) / 2.0f);
+	float midZ = node->back + ((node->front - node->back) / 2.0f);
+	int octant = 0;
+
+	if (box.min.x >= midX) octant += 1;
+	else if (box.max.x > midX) return -1;
+
+	if (box.max.y <= midY) octant += 2;
+	else if (box.min.y < midY) return -1;
+
+	if (box.max.z <= midZ) octant += 4;
+	else if (box.min.z < midZ) return -1;
+
+	return octant;
+}
+
 // Just an AABB collision
-int OctTreeManager::CheckShapeNodeCollide(InteractiveShape* shape, OctTreeNode* node)
+int OctTreeManager::CheckShapeNodeCollide(ShapeHandle handle, OctTreeNode* node)
 {
 	// 0 = no collision
 	// 1 = partial collision
 	// 2 = full collision
 	int colStatus = 0;
-	Collider col = shape->collider();
-	float dTop = node->top - (col.y + col.height / 2.0f);
-	float dBot = node->bottom - (col.y - col.height / 2.0f);
-	float dLeft = node->left - (col.x - col.width / 2.0f);
-	float dRight = node->right - (col.x + col.width / 2.0f);
-	float dFront = node->front - (col.z - col.depth / 2.0f);
-	float dBack = node->back - (col.z + col.depth / 2.0f);
+	const ShapeBox& box = GetShapeBox(handle);
+	float dTop = node->top - box.max.y;
+	float dBot = node->bottom - box.min.y;
+	float dLeft = node->left - box.min.x;
+	float dRight = node->right - box.max.x;
+	float dFront = node->front - box.max.z;
+	float dBack = node->back - box.min.z;
 	float width = node->right - node->left;
 	float height = node->top - node->bottom;
 	float depth = node->front - node->back;
@@ -188,29 +1229,53 @@ int OctTreeManager::CheckShapeNodeCollide(InteractiveShape* shape, OctTreeNode*
 	return colStatus;
 }
 
-void OctTreeManager::InitChildren(int nodeIndex)
-{
-	OctTreeNode* node = _octTree[nodeIndex];
-	float midX = node->left + ((node->right - node->left) / 2.0f);
-	float midY = node->bottom + ((node->top - node->bottom) / 2.0f);
-	float midZ = node->back + ((node->front - node->back) / 2.0f);
-	int childNum = node->children[0] - GetDepthIndex(node->depth);
-	_octTree[node->children[0]] = InitNode(node->depth + 1, nodeIndex, childNum, node->left, midX, node->top, midY, node->front, midZ);
-	_octTree[node->children[1]] = InitNode(node->depth + 1, nodeIndex, childNum + 1, midX, node->right, node->top, midY, node->front, midZ);
-	_octTree[node->children[2]] = InitNode(node->depth + 1, nodeIndex, childNum + 2, node->left, midX, midY, node->bottom, node->front, midZ);
-	_octTree[node->children[3]] = InitNode(node->depth + 1, nodeIndex, childNum + 3, midX, node->right, midY, node->bottom, node->front, midZ);
-	_octTree[node->children[4]] = InitNode(node->depth + 1, nodeIndex, childNum + 4, node->left, midX, node->top, midY, midZ, node->back);
-	_octTree[node->children[5]] = InitNode(node->depth + 1, nodeIndex, childNum + 5, midX, node->right, node->top, midY, midZ, node->back);
-	_octTree[node->children[6]] = InitNode(node->depth + 1, nodeIndex, childNum + 6, node->left, midX, midY, node->bottom, midZ, node->back);
-	_octTree[node->children[7]] = InitNode(node->depth + 1, nodeIndex, childNum + 7, midX, node->right, midY, node->bottom, midZ, node->back);
-}
-
-OctTreeNode* OctTreeManager::InitNode(int depth, int parentIndex, int childNum, float left, float right, float top, float bottom, float front, float back)
+// Nodes that were taken out of the tree earlier are reused before any new ones are made, outline and all, and new ones come out
+// of the node pool. The outlines belong to the oct-tree rather than the render manager, which only draws the ones that
+// GetVisibleShapes hands back.
+OctTreeNode* OctTreeManager::InitNode(std::vector<OctTreeNode*>& freeNodes, OctTreeKey key, unsigned int depth, float left, float right, float top, float bottom, float front, float back)
 {
-	OctTreeNode* node = new OctTreeNode();
+	OctTreeNode* node;
+	if (!freeNodes.empty())
+	{
+		node = freeNodes.back();
+		freeNodes.pop_back();
+	}
+	else
+	{
+		node = MakeNode();
+	}
+	node->outline->active() = false;
+	node->key = key;
 	node->active = false;
 	node->hasChildren = false;
 	node->depth = depth;
+	node->centerOfMass = glm::vec3();
+	node->mass = 0.0f;
+	node->numSamples = 0;
+	node->count = 0;
+	SetBounds(node, left, right, top, bottom, front, back);
+
+	return node;
+}
+
+// Makes a new node and its outline out of the pools. Nodes always give their blocks back before they're taken out of the tree, so
+// only new ones need their shapes emptied.
+OctTreeNode* OctTreeManager::MakeNode()
+{
+	std::lock_guard<std::mutex> lock(_poolMutex);
+	OctTreeNode* node = _nodePool.Create();
+	node->outline = _outlinePool.Create();
+	*node->outline = RenderShape(_outlineTemplate.vao(), _outlineTemplate.count(), _outlineTemplate.mode(), _outlineTemplate.shader(), _outlineTemplate.color());
+	node->outline->active() = false;
+	node->firstBlock = -1;
+	node->lastBlock = -1;
+	node->numShapes = 0;
+	return node;
+}
+
+// Moves the node's sides and fits its outline to them
+void OctTreeManager::SetBounds(OctTreeNode* node, float left, float right, float top, float bottom, float front, float back)
+{
 	node->left = left;
 	node->right = right;
 	node->top = top;
@@ -218,74 +1283,422 @@ OctTreeNode* OctTreeManager::InitNode(int depth, int parentIndex, int childNum,
 	node->front = front;
 	node->back = back;
 
-	RenderShape* outline = new RenderShape(_outlineTemplate.vao(), _outlineTemplate.count(), _outlineTemplate.mode(), _outlineTemplate.shader(), _outlineTemplate.color());
-	RenderManager::AddShape(outline);
-	node->outline = outline;
-	node->outline->active() = false;
-
-	int base = GetDepthIndex(depth) + childNum * 8;
-	node->children[0] = base;
-	node->children[1] = base + 1;
-	node->children[2] = base + 2;
-	node->children[3] = base + 3;
-	node->children[4] = base + 4;
-	node->children[5] = base + 5;
-	node->children[6] = base + 6;
-	node->children[7] = base + 7;
-	node->parent = parentIndex;
-
 	node->outline->transform().position.x = (node->left + node->right) / 2.0f;
 	node->outline->transform().position.y = (node->top + node->bottom) / 2.0f;
 	node->outline->transform().position.z = (node->front + node->back) / 2.0f;
 	node->outline->transform().scale.x = (node->right - node->left) / 2.0f;
 	node->outline->transform().scale.y = (node->top - node->bottom) / 2.0f;
 	node->outline->transform().scale.z = (node->front - node->back) / 2.0f;
-
-	return node;
 }
 
-void OctTreeManager::ActivateChildren(OctTreeNode* parent)
+// Makes the node's eight children, active and in the order GetChildOctant numbers them, without putting them into the node table
+void OctTreeManager::InitChildren(OctTreeNode* parent, std::vector<OctTreeNode*>& freeNodes, OctTreeNode** children)
 {
+	float midX = parent->left + ((parent->right - parent->left) / 2.0f);
+	float midY = parent->bottom + ((parent->top - parent->bottom) / 2.0f);
+	float midZ = parent->back + ((parent->front - parent->back) / 2.0f);
+	OctTreeKey childKey = parent->key << 3;
+	unsigned int depth = parent->depth + 1;
 	parent->hasChildren = true;
-	ActivateNode(_octTree[parent->children[0]]);
-	ActivateNode(_octTree[parent->children[1]]);
-	ActivateNode(_octTree[parent->children[2]]);
-	ActivateNode(_octTree[parent->children[3]]);
-	ActivateNode(_octTree[parent->children[4]]);
-	ActivateNode(_octTree[parent->children[5]]);
-	ActivateNode(_octTree[parent->children[6]]);
-	ActivateNode(_octTree[parent->children[7]]);
+	children[0] = InitNode(freeNodes, childKey, depth, parent->left, midX, parent->top, midY, parent->front, midZ);
+	children[1] = InitNode(freeNodes, childKey | 1, depth, midX, parent->right, parent->top, midY, parent->front, midZ);
+	children[2] = InitNode(freeNodes, childKey | 2, depth, parent->left, midX, midY, parent->bottom, parent->front, midZ);
+	children[3] = InitNode(freeNodes, childKey | 3, depth, midX, parent->right, midY, parent->bottom, parent->front, midZ);
+	children[4] = InitNode(freeNodes, childKey | 4, depth, parent->left, midX, parent->top, midY, midZ, parent->back);
+	children[5] = InitNode(freeNodes, childKey | 5, depth, midX, parent->right, parent->top, midY, midZ, parent->back);
+	children[6] = InitNode(freeNodes, childKey | 6, depth, parent->left, midX, midY, parent->bottom, midZ, parent->back);
+	children[7] = InitNode(freeNodes, childKey | 7, depth, midX, parent->right, midY, parent->bottom, midZ, parent->back);
+	for (int j = 0; j < 8; ++j)
+	{
+		ActivateNode(children[j]);
+	}
 }
 
-void OctTreeManager::ResetTree()
+// Adds the shape to the end of the node's last block, taking a new block off the free list once that one is full. The buffer
+// itself only grows when the free list is empty, and AddShape has already made room for that.
+void OctTreeManager::PushShape(OctTreeNode* node, ShapeHandle handle)
+{
+	unsigned int pos = node->numShapes % OctTreeShapeBlock::SIZE;
+	if (pos == 0)
+	{
+		int block = _freeBlock;
+		if (block >= 0)
+		{
+			_freeBlock = _shapeBlocks[block].next;
+		}
+		else
+		{
+			block = _shapeBlocks.size();
+			_shapeBlocks.push_back(OctTreeShapeBlock());
+		}
+		_shapeBlocks[block].next = -1;
+		if (node->lastBlock >= 0)
+		{
+			_shapeBlocks[node->lastBlock].next = block;
+		}
+		else
+		{
+			node->firstBlock = block;
+		}
+		node->lastBlock = block;
+	}
+	_shapeBlocks[node->lastBlock].shapes[pos] = handle;
+	++node->numShapes;
+}
+
+// The node's blocks are already chained together, so the whole chain goes onto the front of the free list at once
+void OctTreeManager::ClearShapes(OctTreeNode* node)
+{
+	if (node->firstBlock >= 0)
+	{
+		_shapeBlocks[node->lastBlock].next = _freeBlock;
+		_freeBlock = node->firstBlock;
+	}
+	node->firstBlock = -1;
+	node->lastBlock = -1;
+	node->numShapes = 0;
+}
+
+OctTreeShapeRange OctTreeManager::GetShapes(const OctTreeNode* node)
 {
-	std::stack<int> stack;
-	stack.push(0);
+	return OctTreeShapeRange(_shapeBlocks.empty() ? nullptr : &_shapeBlocks[0], node->firstBlock, node->numShapes);
+}
 
-	while (!stack.empty())
+void OctTreeManager::ActivateChildren(OctTreeNode* parent)
+{
+	OctTreeNode* children[8];
+	InitChildren(parent, _freeNodes, children);
+	for (int j = 0; j < 8; ++j)
 	{
-		OctTreeNode* node = _octTree[stack.top()];
-		stack.pop();
+		InsertNode(children[j]);
+	}
+}
 
-		if (node->active)
+// Every node but the root goes back to the free list. The table is cleared in one go instead of erasing the nodes one by one.
+void OctTreeManager::ResetTree()
+{
+	OctTreeNode* root = FindNode(ROOT_KEY);
+	unsigned int tableSize = _nodeTable.size();
+	for (unsigned int i = 0; i < tableSize; ++i)
+	{
+		OctTreeNode* node = _nodeTable[i].node;
+		if (node && node != root)
 		{
 			node->active = false;
-			node->shapes.clear();
+			ClearShapes(node);
 			node->outline->active() = false;
+			_freeNodes.push_back(node);
+		}
+	}
+	_nodeTable.assign(tableSize, NodeSlot());
+	_numNodes = 0;
+
+	root->active = false;
+	root->hasChildren = false;
+	ClearShapes(root);
+	root->outline->active() = false;
+	InsertNode(root);
+}
+
+// The node's last shape takes the removed shape's place, and the node's last block goes back on the free list once it's empty
+void OctTreeManager::RemoveFromNode(ShapeHandle handle, OctTreeKey nodeKey)
+{
+	OctTreeNode* node = FindNode(nodeKey);
+	ShapeHandle last = _shapeBlocks[node->lastBlock].shapes[(node->numShapes - 1) % OctTreeShapeBlock::SIZE];
+	for (int block = node->firstBlock; block >= 0; block = _shapeBlocks[block].next)
+	{
+		ShapeHandle* shapes = _shapeBlocks[block].shapes;
+		unsigned int size = block == node->lastBlock ? (node->numShapes - 1) % OctTreeShapeBlock::SIZE + 1 : OctTreeShapeBlock::SIZE;
+		ShapeHandle* found = std::find(shapes, shapes + size, handle);
+		if (found != shapes + size)
+		{
+			*found = last;
+			break;
+		}
+	}
+	--node->numShapes;
+	if (node->numShapes % OctTreeShapeBlock::SIZE == 0)
+	{
+		int previous = -1;
+		for (int block = node->firstBlock; block != node->lastBlock; block = _shapeBlocks[block].next)
+		{
+			previous = block;
+		}
+		_shapeBlocks[node->lastBlock].next = _freeBlock;
+		_freeBlock = node->lastBlock;
+		node->lastBlock = previous;
+		if (previous >= 0)
+		{
+			_shapeBlocks[previous].next = -1;
+		}
+		else
+		{
+			node->firstBlock = -1;
+		}
+	}
+	_shapeNodes[handle] = 0;
+	_collapseCandidates.push_back(nodeKey);
+}
+
+// Collapsing is left until the end of the update so that a shape passing from one octant to its neighbor doesn't tear down and
+// rebuild the same children. A node's children are collapsed once they are all leaves and, together with the node, hold fewer
+// shapes than would have caused the split in the first place. Collapsing one node can leave its parent underfull, so each
+// collapse moves on up the tree. A candidate may already be gone if an earlier collapse took it out of the tree.
+void OctTreeManager::CollapseUnderfull()
+{
+	ProfileZone zone("OctTreeManager::CollapseUnderfull");
+	unsigned int size = _collapseCandidates.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		OctTreeKey nodeKey = _collapseCandidates[i];
+		OctTreeNode* node = FindNode(nodeKey);
+		if (!node) continue;
+		if (!node->hasChildren && node->depth != 0)
+		{
+			nodeKey = nodeKey >> 3;
+			node = FindNode(nodeKey);
+		}
+
+		while (node->hasChildren)
+		{
+			OctTreeNode* children[8];
+			unsigned int count = node->numShapes;
+			bool leaves = true;
+			for (int j = 0; j < 8; ++j)
+			{
+				children[j] = FindNode((nodeKey << 3) | j);
+				leaves = leaves && !children[j]->hasChildren;
+				count += children[j]->numShapes;
+			}
+			if (!leaves || count >= _maxPerNode) break;
+
+			for (int j = 0; j < 8; ++j)
+			{
+				OctTreeShapeRange childShapes = GetShapes(children[j]);
+				for (OctTreeShapeRange::iterator it = childShapes.begin(); it != childShapes.end(); ++it)
+				{
+					PushShape(node, *it);
+					_shapeNodes[*it] = nodeKey;
+				}
+				DeactivateNode(children[j]);
+			}
+			node->hasChildren = false;
+			++_stats.collapses;
+
+			if (node->depth == 0) break;
+			nodeKey = nodeKey >> 3;
+			node = FindNode(nodeKey);
+		}
+	}
+	_collapseCandidates.clear();
+}
+
+// While unbounded, the root doubles in size toward a shape outside of it until the shape fits. If the root has children it stays
+// as it is, with everything below it, and becomes one of the children of a new root twice its size, so only the keys change.
+// The max depth goes up along with the root so that the smallest nodes stay the same size. Once keys have no room left for
+// another level, the deepest level is folded into its parents instead.
+void OctTreeManager::GrowRoot(ShapeHandle handle)
+{
+	OctTreeNode* root = FindNode(ROOT_KEY);
+	const ShapeBox& box = GetShapeBox(handle);
+	// No number of doublings fits a box that is infinite or NaN, so a shape like that is left in the root as it is
+	glm::vec3 largest(std::numeric_limits<float>::max());
+	if (!glm::all(glm::lessThanEqual(glm::abs(box.min), largest)) || !glm::all(glm::lessThanEqual(glm::abs(box.max), largest))) return;
+	if (CheckShapeNodeCollide(handle, root) != 2) _shrinkFrames = 0;
+	while (CheckShapeNodeCollide(handle, root) != 2)
+	{
+		float width = root->right - root->left;
+		float height = root->top - root->bottom;
+		float depth = root->front - root->back;
+		float left = root->left;
+		float right = root->right;
+		float top = root->top;
+		float bottom = root->bottom;
+		float front = root->front;
+		float back = root->back;
+		// The old root's octant in the new one, numbered the same way GetChildOctant does
+		int octant = 0;
+		if (box.min.x < root->left)
+		{
+			left -= width;
+			octant += 1;
+		}
+		else right += width;
+		if (box.max.y > root->top)
+		{
+			top += height;
+			octant += 2;
+		}
+		else bottom -= height;
+		if (box.max.z > root->front)
+		{
+			front += depth;
+			octant += 4;
+		}
+		else back -= depth;
+
+		if (_maxDepth < MAX_KEY_DEPTH) ++_maxDepth;
+		else if (root->hasChildren) MergeDeepestLevel();
+
+		if (!root->hasChildren)
+		{
+			SetBounds(root, left, right, top, bottom, front, back);
+			continue;
+		}
+
+		RekeyNodes(octant);
+		OctTreeNode* newRoot = InitNode(_freeNodes, ROOT_KEY, 0, left, right, top, bottom, front, back);
+		ActivateNode(newRoot);
+		OctTreeNode* children[8];
+		InitChildren(newRoot, _freeNodes, children);
+		for (int j = 0; j < 8; ++j)
+		{
+			if (j != octant)
+			{
+				InsertNode(children[j]);
+				continue;
+			}
+			// The old root is already in the table in this child's place
+			children[j]->active = false;
+			children[j]->outline->active() = false;
+			_freeNodes.push_back(children[j]);
+		}
+		InsertNode(newRoot);
+		root = newRoot;
+	}
+}
+
+// Once the root holds nothing itself and every shape is inside one of its children, that child takes over as the root and the
+// rest of the old root's children are taken out. The root has to have been able to shrink for ROOT_SHRINK_FRAMES updates in a
+// row first, and then only goes down one level before waiting again, so shapes moving about near the edge of a child don't
+// keep undoing the work of GrowRoot. A world that has spread out and come back together still sheds its empty levels over time.
+void OctTreeManager::ShrinkRoot()
+{
+	OctTreeNode* root = FindNode(ROOT_KEY);
+	if (!root->hasChildren || root->numShapes != 0 || _maxDepth == 0)
+	{
+		_shrinkFrames = 0;
+		return;
+	}
+
+	OctTreeNode* children[8];
+	int keep = -1;
+	for (int j = 0; j < 8; ++j)
+	{
+		children[j] = FindNode((ROOT_KEY << 3) | j);
+		if (children[j]->hasChildren || children[j]->numShapes != 0)
+		{
+			if (keep >= 0)
+			{
+				_shrinkFrames = 0;
+				return;
+			}
+			keep = j;
+		}
+	}
+	if (keep < 0)
+	{
+		_shrinkFrames = 0;
+		return;
+	}
+	if (++_shrinkFrames < ROOT_SHRINK_FRAMES) return;
+
+	_shrinkFrames = 0;
+	for (int j = 0; j < 8; ++j)
+	{
+		if (j != keep)
+		{
+			DeactivateNode(children[j]);
+		}
+	}
+	DeactivateNode(root);
+	RekeyNodes(-1);
+	--_maxDepth;
+}
+
+// Keys only have room for MAX_KEY_DEPTH levels below the root, so before a root that might be using all of them can grow, the
+// shapes in the deepest level are moved up into their parents and the deepest nodes are taken out
+void OctTreeManager::MergeDeepestLevel()
+{
+	_nodeList.clear();
+	unsigned int tableSize = _nodeTable.size();
+	for (unsigned int i = 0; i < tableSize; ++i)
+	{
+		OctTreeNode* node = _nodeTable[i].node;
+		if (node && node->depth == MAX_KEY_DEPTH - 1 && node->hasChildren)
+		{
+			_nodeList.push_back(node);
+		}
+	}
 
-			if (node->hasChildren)
+	unsigned int size = _nodeList.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		OctTreeNode* node = _nodeList[i];
+		for (int j = 0; j < 8; ++j)
+		{
+			OctTreeNode* child = FindNode((node->key << 3) | j);
+			OctTreeShapeRange childShapes = GetShapes(child);
+			for (OctTreeShapeRange::iterator it = childShapes.begin(); it != childShapes.end(); ++it)
 			{
-				stack.push(node->children[0]);
-				stack.push(node->children[1]);
-				stack.push(node->children[2]);
-				stack.push(node->children[3]);
-				stack.push(node->children[4]);
-				stack.push(node->children[5]);
-				stack.push(node->children[6]);
-				stack.push(node->children[7]);
+				PushShape(node, *it);
+				_shapeNodes[*it] = node->key;
 			}
+			DeactivateNode(child);
+		}
+		node->hasChildren = false;
+	}
+}
+
+// Every node moves to the key RekeyKey gives it, one level deeper when a root has been put above them and one level shallower
+// when the root has been taken away. The table is emptied and refilled since nearly every key hashes somewhere new, and the keys
+// recorded for each shape and each collapse candidate are moved along with the nodes.
+void OctTreeManager::RekeyNodes(int octant)
+{
+	_nodeList.clear();
+	unsigned int tableSize = _nodeTable.size();
+	for (unsigned int i = 0; i < tableSize; ++i)
+	{
+		if (_nodeTable[i].node)
+		{
+			_nodeList.push_back(_nodeTable[i].node);
 		}
 	}
+	_nodeTable.assign(tableSize, NodeSlot());
+	_numNodes = 0;
+
+	unsigned int size = _nodeList.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		OctTreeNode* node = _nodeList[i];
+		node->key = RekeyKey(node->key, octant);
+		node->depth = octant >= 0 ? node->depth + 1 : node->depth - 1;
+		InsertNode(node);
+	}
+
+	size = _shapeNodes.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		if (_shapeNodes[i] != 0)
+		{
+			_shapeNodes[i] = RekeyKey(_shapeNodes[i], octant);
+		}
+	}
+	size = _collapseCandidates.size();
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		_collapseCandidates[i] = RekeyKey(_collapseCandidates[i], octant);
+	}
+}
+
+// Takes the node out of the tree and keeps it for reuse
+void OctTreeManager::DeactivateNode(OctTreeNode* node)
+{
+	node->active = false;
+	ClearShapes(node);
+	node->outline->active() = false;
+	EraseNode(node->key);
+	_freeNodes.push_back(node);
 }
 
 void OctTreeManager::ActivateNode(OctTreeNode* node)
@@ -295,15 +1708,95 @@ void OctTreeManager::ActivateNode(OctTreeNode* node)
 	node->hasChildren = false;
 }
 
-int OctTreeManager::GetDepthIndex(int depth)
+// Linear probing from the slot the key hashes to. Returns nullptr if the node isn't in the tree.
+OctTreeNode* OctTreeManager::FindNode(OctTreeKey key)
+{
+	unsigned int mask = _nodeTable.size() - 1;
+	for (unsigned int i = HashKey(key) & mask; _nodeTable[i].key != 0; i = (i + 1) & mask)
+	{
+		if (_nodeTable[i].key == key)
+		{
+			return _nodeTable[i].node;
+		}
+	}
+	return nullptr;
+}
+
+// The table is kept at most half full so that probe runs stay short
+void OctTreeManager::InsertNode(OctTreeNode* node)
+{
+	if ((_numNodes + 1) * 2 > _nodeTable.size())
+	{
+		GrowTable();
+	}
+
+	unsigned int mask = _nodeTable.size() - 1;
+	unsigned int i = HashKey(node->key) & mask;
+	while (_nodeTable[i].key != 0)
+	{
+		i = (i + 1) & mask;
+	}
+	_nodeTable[i].key = node->key;
+	_nodeTable[i].node = node;
+	++_numNodes;
+}
+
+// Rather than leaving a marker behind, the entries after the removed one are shifted back into the gap when their probe run
+// passes through it. That way lookups never have to step over dead entries no matter how often nodes come and go.
+void OctTreeManager::EraseNode(OctTreeKey key)
+{
+	unsigned int mask = _nodeTable.size() - 1;
+	unsigned int hole = HashKey(key) & mask;
+	while (_nodeTable[hole].key != key)
+	{
+		if (_nodeTable[hole].key == 0) return;
+		hole = (hole + 1) & mask;
+	}
+
+	for (unsigned int i = (hole + 1) & mask; _nodeTable[i].key != 0; i = (i + 1) & mask)
+	{
+		unsigned int home = HashKey(_nodeTable[i].key) & mask;
+		// The entry can only move back if the hole is no further from its home slot than where it sits now
+		if (((i - home) & mask) >= ((i - hole) & mask))
+		{
+			_nodeTable[hole] = _nodeTable[i];
+			hole = i;
+		}
+	}
+	_nodeTable[hole] = NodeSlot();
+	--_numNodes;
+}
+
+void OctTreeManager::GrowTable()
 {
-	float depthf = (float)depth;
-	float retf = 0.0f;
-	for (float i = 0.0f; i < depthf || i == depthf; i += 1.0f)
+	_oldTable.swap(_nodeTable);
+	_nodeTable.assign(_oldTable.size() * 2, NodeSlot());
+	_numNodes = 0;
+
+	unsigned int oldSize = _oldTable.size();
+	for (unsigned int i = 0; i < oldSize; ++i)
 	{
-		retf += powf(8.0f, i);
+		if (_oldTable[i].node)
+		{
+			InsertNode(_oldTable[i].node);
+		}
 	}
-	int ret = (int)retf;
-	return  ret;
 }
 
+// Tests the box against each frustum plane still set in the mask. Planes that the box is entirely inside of are cleared from
+// the mask so that nothing within the box has to test them again. Returns false once the box is entirely outside any plane.
+bool OctTreeManager::ClassifyBox(const glm::vec3& boxMin, const glm::vec3& boxMax, int& planeMask)
+{
+	for (int i = 0; i < 6; ++i)
+	{
+		if (!(planeMask & (1 << i))) continue;
+
+		const glm::vec4& plane = _frustumPlanes[i];
+		// The corners of the box furthest along and furthest against the plane's normal
+		glm::vec3 inner = glm::vec3(plane.x > 0.0f ? boxMax.x : boxMin.x, plane.y > 0.0f ? boxMax.y : boxMin.y, plane.z > 0.0f ? boxMax.z : boxMin.z);
+		glm::vec3 outer = glm::vec3(plane.x > 0.0f ? boxMin.x : boxMax.x, plane.y > 0.0f ? boxMin.y : boxMax.y, plane.z > 0.0f ? boxMin.z : boxMax.z);
+		if (glm::dot(glm::vec3(plane), inner) + plane.w < 0.0f) return false;
+		if (glm::dot(glm::vec3(plane), outer) + plane.w >= 0.0f) planeMask &= ~(1 << i);
+	}
+	return true;
+}
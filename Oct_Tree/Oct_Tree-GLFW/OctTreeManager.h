@@ -1,15 +1,38 @@
 #pragma once
+#include <GLM\glm.hpp>
 #include <vector>
+#include <mutex>
+#include "NodePool.h"
+#include "TreeStats.h"
+#include "ShapeStore.h"
 
 class InteractiveShape;
 class RenderShape;
 
+// Names a node by the path taken to reach it from the root. The highest set bit marks the start of the path and every three
+// bits after it give the octant chosen at the next level down, so the key is the node's Morton code with its depth built in.
+typedef unsigned long long OctTreeKey;
+
+// A piece of a node's list of shapes. Every node's blocks come out of one buffer, chained together by their index in it, and
+// blocks a node no longer needs go on a free list in the same buffer. Nodes move shapes around all the time, so none of them
+// owns a list that could grow.
+struct OctTreeShapeBlock
+{
+	static const unsigned int SIZE = 8;
+
+	ShapeHandle shapes[SIZE];
+	// The next block of the same node, or the next free block, or -1 for the last one
+	int next;
+};
+
 struct OctTreeNode
 {
-	std::vector<InteractiveShape*> shapes;
+	// The first and last blocks of this node's shapes, or -1 if it has none. Every block but the last is full.
+	int firstBlock;
+	int lastBlock;
+	unsigned int numShapes;
 	RenderShape* outline;
-	int children[8];
-	int parent;
+	OctTreeKey key;
 
 	bool active;
 	bool hasChildren;
@@ -20,6 +43,74 @@ struct OctTreeNode
 	float bottom;
 	float front;
 	float back;
+	// The total mass of every shape in this node and below it, and where the center of that mass is. These are only kept up to
+	// date while gravity is on.
+	glm::vec3 centerOfMass;
+	float mass;
+	// A handful of the shapes in this node and below it, shared out between the node and its children by how many shapes each
+	// holds, along with how many shapes there are in all and their average position and color. These are only kept up to date in
+	// point cloud mode.
+	static const unsigned int MAX_SAMPLES = 8;
+	ShapeHandle samples[MAX_SAMPLES];
+	unsigned int numSamples;
+	unsigned int count;
+	glm::vec3 centroid;
+	glm::vec4 color;
+};
+
+// A single point standing in for a number of shapes in a level of detail approximation
+struct OctTreeLodPoint
+{
+	glm::vec3 position;
+	glm::vec4 color;
+	unsigned int count;
+};
+
+// A view of the handles of the shapes in a single node, read straight out of the node's blocks. Nothing is copied, so the view
+// is only valid until the node's shapes next change.
+class OctTreeShapeRange
+{
+public:
+
+	class iterator
+	{
+	public:
+		iterator(const OctTreeShapeBlock* blocks, int block, unsigned int remaining) : _blocks(blocks), _block(block), _pos(0), _remaining(remaining) {}
+
+		ShapeHandle operator*() const { return _blocks[_block].shapes[_pos]; }
+		iterator& operator++()
+		{
+			--_remaining;
+			if (++_pos == OctTreeShapeBlock::SIZE)
+			{
+				_block = _blocks[_block].next;
+				_pos = 0;
+			}
+			return *this;
+		}
+		bool operator==(const iterator& other) const { return _remaining == other._remaining; }
+		bool operator!=(const iterator& other) const { return _remaining != other._remaining; }
+
+	private:
+
+		const OctTreeShapeBlock* _blocks;
+		int _block;
+		unsigned int _pos;
+		unsigned int _remaining;
+	};
+
+	OctTreeShapeRange(const OctTreeShapeBlock* blocks = nullptr, int firstBlock = -1, unsigned int size = 0) : _blocks(blocks), _firstBlock(firstBlock), _size(size) {}
+
+	iterator begin() const { return iterator(_blocks, _firstBlock, _size); }
+	iterator end() const { return iterator(_blocks, -1, 0); }
+	unsigned int size() const { return _size; }
+	bool empty() const { return _size == 0; }
+
+private:
+
+	const OctTreeShapeBlock* _blocks;
+	int _firstBlock;
+	unsigned int _size;
 };
 
 class OctTreeManager
@@ -30,21 +121,109 @@ public:
 
 	static void UpdateOctTree();
 
+	static void RebuildOctTree();
+
 	static void AddShape(InteractiveShape* shape);
 
 	static void DumpData();
 
 	static const std::vector<InteractiveShape*>& GetNearbyShapes(InteractiveShape* shape);
 
+	static void GetVisibleShapes(const glm::mat4& viewProjMat, std::vector<InteractiveShape*>& shapes, std::vector<RenderShape*>& outlines);
+
+	static InteractiveShape* RaycastShapes(const glm::vec3& origin, const glm::vec3& direction, float* hitDistance = nullptr);
+
+	static void GetSweptShapes(InteractiveShape* shape, const glm::vec3& start, const glm::vec3& end, std::vector<std::pair<float, InteractiveShape*>>& hits);
+
+	static void GetSweptShapes(InteractiveShape* shape, float dt, std::vector<std::pair<float, InteractiveShape*>>& hits);
+
+	static void SetGravity(float gravityConstant, float openingAngle = 0.5f);
+
+	static void ApplyGravity(float dt);
+
+	static float gravityConstant();
+
+	static void SetUnbounded(bool unbounded);
+
+	static bool unbounded();
+
+	static void SetPointCloud(bool pointCloud);
+
+	static bool pointCloud();
+
+	static void GetLodShapes(const glm::vec3& eye, unsigned int maxShapes, std::vector<InteractiveShape*>& shapes);
+
+	static void GetLodPoints(const glm::vec3& eye, unsigned int maxPoints, std::vector<OctTreeLodPoint>& points);
+
+	static void GetStats(TreeStats& stats);
+
+	static void ResetStats();
+
+	static unsigned int maxNodes();
+
+	static void ReserveNodes();
+
 private:
 
-	static void AddShape(InteractiveShape* shape, int startingNode);
+	// An entry in the node table. Empty entries have a key of 0, which no node can have.
+	struct NodeSlot
+	{
+		OctTreeKey key;
+		OctTreeNode* node;
+	};
+
+	static void AddShape(ShapeHandle handle, OctTreeKey startingNode);
+
+	static int CheckShapeNodeCollide(ShapeHandle handle, OctTreeNode* node);
+
+	static int GetChildOctant(ShapeHandle handle, OctTreeNode* node);
+
+	// A node still to be filled during a parallel build, along with the range of its octant's shapes that belong in it
+	struct BuildTask
+	{
+		OctTreeNode* node;
+		int begin;
+		int end;
+
+		BuildTask(OctTreeNode* taskNode, int taskBegin, int taskEnd) : node(taskNode), begin(taskBegin), end(taskEnd) {}
+	};
+
+	// Everything one thread needs to build part of the tree without touching anything shared with the other threads
+	struct BuildScratch
+	{
+		// Nodes this thread can hand out before it has to make new ones
+		std::vector<OctTreeNode*> freeNodes;
+		// Nodes this thread has made, which go into the node table once every thread is done
+		std::vector<OctTreeNode*> nodes;
+		// The node each shape ended up in
+		std::vector<std::pair<ShapeHandle, OctTreeKey>> placements;
+		std::vector<BuildTask> stack;
+		std::vector<int> octants;
+		std::vector<ShapeHandle> sorted;
+		// Nodes this thread split and the shapes it sorted into their children, added to the stats once every thread is done
+		unsigned int subdivisions;
+		unsigned long long subdivisionShapes;
+
+		BuildScratch() : subdivisions(0), subdivisionShapes(0) {}
+	};
+
+	static void BuildParallel();
+
+	static void BuildOctant(int octant, BuildScratch& scratch);
+
+	static OctTreeNode* MakeNode();
+
+	static OctTreeNode* InitNode(std::vector<OctTreeNode*>& freeNodes, OctTreeKey key, unsigned int depth, float left, float right, float top, float bottom, float front, float back);
+
+	static void SetBounds(OctTreeNode* node, float left, float right, float top, float bottom, float front, float back);
 
-	static int CheckShapeNodeCollide(InteractiveShape* shape, OctTreeNode* node);
+	static void InitChildren(OctTreeNode* parent, std::vector<OctTreeNode*>& freeNodes, OctTreeNode** children);
 
-	static void InitChildren(int nodeIndex);
+	static void PushShape(OctTreeNode* node, ShapeHandle handle);
 
-	static OctTreeNode* InitNode(int depth, int parentIndex, int childNum, float left, float right, float top, float bottom, float front, float back);
+	static void ClearShapes(OctTreeNode* node);
+
+	static OctTreeShapeRange GetShapes(const OctTreeNode* node);
 
 	static void ActivateChildren(OctTreeNode* parent);
 
@@ -52,12 +231,98 @@ private:
 
 	static void ResetTree();
 
+	static void RemoveFromNode(ShapeHandle handle, OctTreeKey nodeKey);
+
+	static void CollapseUnderfull();
+
+	static void GrowRoot(ShapeHandle handle);
+
+	static void ShrinkRoot();
+
+	static void MergeDeepestLevel();
+
+	static void RekeyNodes(int octant);
+
 	static void ActivateNode(OctTreeNode* node);
 
-	static int GetDepthIndex(int depth);
+	static OctTreeNode* FindNode(OctTreeKey key);
+
+	static void InsertNode(OctTreeNode* node);
+
+	static void EraseNode(OctTreeKey key);
+
+	static void GrowTable();
+
+	static bool ClassifyBox(const glm::vec3& boxMin, const glm::vec3& boxMax, int& planeMask);
+
+	static void OrderNodes();
+
+	static void UpdateMass();
+
+	static void UpdateLod();
+
+	static void SelectLod(const glm::vec3& eye, unsigned int budget, bool samples);
+
+	static glm::vec3 GetGravity(ShapeHandle handle);
 
-	static std::vector<OctTreeNode*> _octTree;
-	static std::vector<InteractiveShape*> _shapes;
+	// Open addressed table of every node currently in the tree. Its size is always a power of two.
+	static std::vector<NodeSlot> _nodeTable;
+	static unsigned int _numNodes;
+	// The table as it was before it last grew, kept so that growing it again doesn't have to allocate a second one
+	static std::vector<NodeSlot> _oldTable;
+	// Nodes taken out of the tree, kept along with their outlines so they can be handed out again
+	static std::vector<OctTreeNode*> _freeNodes;
+	// The blocks holding every node's shapes, and the first of the blocks no node is using, or -1 if there are none
+	static std::vector<OctTreeShapeBlock> _shapeBlocks;
+	static int _freeBlock;
+	// Shapes being handed down to the children of nodes that are splitting, and nodes gathered up while the root grows or shrinks
+	static std::vector<ShapeHandle> _splitShapes;
+	static std::vector<OctTreeNode*> _nodeList;
+	// Every node and outline ever made comes out of these pools. The lock is for the threads of a parallel build, which can
+	// each run out of free nodes at the same time.
+	static NodePool<OctTreeNode> _nodePool;
+	static NodePool<RenderShape> _outlinePool;
+	static std::mutex _poolMutex;
+	// The handles of every shape in the tree. Nodes hold handles too, so the tree only ever reads the shape store's arrays and
+	// the shapes themselves are only looked up when they're handed back out.
+	static std::vector<ShapeHandle> _shapes;
+	// Where each shape was the last time the tree was updated, lined up with _shapes
+	static std::vector<glm::vec3> _lastPositions;
+	// The node each shape is currently stored in, indexed by the shape's handle. Every key has its start bit set, so 0 marks a shape
+	// that isn't in the tree. Moving a shape between nodes only overwrites its entry, so nothing is allocated.
+	static std::vector<OctTreeKey> _shapeNodes;
+	// The shapes last handed back by GetNearbyShapes
+	static std::vector<InteractiveShape*> _nearbyShapes;
+	// Nodes that have lost shapes since the last update and may now be worth collapsing
+	static std::vector<OctTreeKey> _collapseCandidates;
+	// Planes of the view frustum being queried, facing inwards, along with the nodes still to visit and which planes each straddles
+	static glm::vec4 _frustumPlanes[6];
+	static std::vector<std::pair<OctTreeKey, int>> _frustumStack;
+	// Nodes the ray still has to look at, along with how far along the ray it enters each one
+	static std::vector<std::pair<float, OctTreeKey>> _rayStack;
+	static std::vector<OctTreeKey> _sweepStack;
+	// Gravity is off while the constant is 0. The opening angle is how large a node can look from a shape, as its width over its
+	// distance, before it's too close to be treated as a single mass.
+	static float _gravityConstant;
+	static float _openingAngle;
+	// Every node in the tree with parents before their children, and the nodes still to visit while adding up the pull on a shape
+	static std::vector<OctTreeNode*> _nodeOrder;
+	static std::vector<OctTreeNode*> _gravityStack;
+	// Whether each node's samples and averages are kept up to date. While picking a level of detail, the heap holds the nodes that
+	// could still be opened, largest looking first, and the nodes left unopened and the shapes of the opened ones are collected.
+	static bool _pointCloud;
+	static std::vector<std::pair<float, OctTreeNode*>> _lodHeap;
+	static std::vector<OctTreeNode*> _lodNodes;
+	static std::vector<ShapeHandle> _lodShapes;
+	// The shapes going into each of the root's octants during a parallel build, and each thread's working space
+	static std::vector<ShapeHandle> _octantShapes[8];
+	static std::vector<BuildScratch> _buildScratch;
+	// While unbounded the root grows to fit any shape outside of it and shrinks back down when the shapes no longer need it
+	static bool _unbounded;
+	// Updates in a row that the root could have shrunk
+	static unsigned int _shrinkFrames;
+	// The running counts for the stats. The rest of the stats are worked out from the nodes when they're asked for.
+	static TreeStats _stats;
 	static unsigned int _maxDepth;
 	static unsigned int _maxPerNode;
 	static RenderShape _outlineTemplate;
@@ -4,13 +4,25 @@
 #include "Init_Shader.h"
 #include "InputManager.h"
 #include "OctTreeManager.h"
+#include "ShapeStore.h"
+#include "JobManager.h"
+#include "Profiler.h"
 #include <GLM\gtc\random.hpp>
 
 std::vector<RenderShape*> RenderManager::_shapes = std::vector<RenderShape*>();
 std::vector<InteractiveShape*> RenderManager::_interactiveShapes = std::vector<InteractiveShape*>();
+std::vector<InteractiveShape*> RenderManager::_visibleShapes = std::vector<InteractiveShape*>();
+std::vector<RenderShape*> RenderManager::_visibleOutlines = std::vector<RenderShape*>();
+std::vector<DrawCall> RenderManager::_drawCalls = std::vector<DrawCall>();
+InteractiveShape* RenderManager::_mousedShape = nullptr;
 
 glm::mat4 RenderManager::_projMat = glm::perspectiveFov(37.5f, 1.337f, 1.0f, 0.1f, 100.0f);
 
+// How strongly the shapes pull on each other while gravity is turned on
+static const float GRAVITY_CONSTANT = 0.001f;
+// How many shapes each thread updates at a time
+static const int UPDATE_CHUNK_SIZE = 256;
+
 void RenderManager::GenerateShapes(Shader shader, GLuint vao, int numShapes, GLenum type, GLsizei count)
 {
 	Collider collider = InteractiveShape::MakeCollider(0.035f, 0.035f, 0.035f, 0.0f, 0.0f, 0.0f);
@@ -29,6 +41,10 @@ void RenderManager::AddShape(Shader shader, GLuint vao, GLenum type, GLsizei cou
 {
 	_interactiveShapes.push_back(new InteractiveShape(collider, vao, count, type, shader, color));
 	_interactiveShapes[_interactiveShapes.size() - 1]->transform() = transform;
+	// The shape store moves interactive shapes, so the transform's position and velocity are handed over to it
+	_interactiveShapes[_interactiveShapes.size() - 1]->SetPosition(transform.position);
+	_interactiveShapes[_interactiveShapes.size() - 1]->SetVelocity(transform.linearVelocity);
+	_interactiveShapes[_interactiveShapes.size() - 1]->transform().linearVelocity = glm::vec3();
 }
 
 void RenderManager::AddShape(Shader shader, GLuint vao, GLenum type, GLsizei count, glm::vec4 color, Transform transform)
@@ -43,48 +59,128 @@ void RenderManager::AddShape(RenderShape* shape)
 	_shapes[_shapes.size() - 1]->transform() = shape->transform();
 }
 
+// Shapes are updated in chunks spread across the job manager's threads. A shape's update only touches the shape itself, so the
+// threads never share anything while they work. Everything that reads or changes the oct-tree stays on this thread.
 void RenderManager::Update(float dt)
 {
-	std::vector<InteractiveShape*>& moused = std::vector<InteractiveShape*>();
-	unsigned int numShapes = _shapes.size();
-	for (unsigned int i = 0; i < numShapes; ++i)
+	ProfileZone zone("RenderManager::Update");
+	JobManager::ParallelFor((int)_shapes.size(), UPDATE_CHUNK_SIZE, [dt](int begin, int end, unsigned int /*thread*/)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			_shapes[i]->Update(dt);
+		}
+	});
+
+	// G turns gravity between the shapes on and off. The oct-tree works out the pull on each shape and adds it to its velocity.
+	if (!InputManager::gKey(false) && InputManager::gKey(true))
 	{
-		_shapes[i]->Update(dt);
+		OctTreeManager::SetGravity(OctTreeManager::gravityConstant() == 0.0f ? GRAVITY_CONSTANT : 0.0f);
 	}
-	numShapes = _interactiveShapes.size();
-	for (unsigned int i = 0; i < numShapes; ++i)
+	OctTreeManager::ApplyGravity(dt);
+
+	unsigned int numShapes = _interactiveShapes.size();
+	if (!InputManager::spaceKey(false) && InputManager::spaceKey(true))
 	{
-		if (!InputManager::spaceKey(false) && InputManager::spaceKey(true))
+		for (unsigned int i = 0; i < numShapes; ++i)
 		{
-			_interactiveShapes[i]->transform().linearVelocity = _interactiveShapes[i]->transform().linearVelocity.x == 0.0f ? glm::vec3(glm::linearRand(-0.5f, 0.5f), glm::linearRand(-0.5f, 0.5f), glm::linearRand(-0.5f, 0.5f)) : glm::vec3();
+			_interactiveShapes[i]->SetVelocity(_interactiveShapes[i]->velocity().x == 0.0f ? glm::vec3(glm::linearRand(-0.5f, 0.5f), glm::linearRand(-0.5f, 0.5f), glm::linearRand(-0.5f, 0.5f)) : glm::vec3());
 		}
-		_interactiveShapes[i]->Update(dt);
-		if (_interactiveShapes[i]->mouseOver())
+	}
+	// Every interactive shape is moved in one pass over the shape store before the shapes themselves catch up with it
+	ShapeStore::Integrate(dt);
+	JobManager::ParallelFor((int)numShapes, UPDATE_CHUNK_SIZE, [dt](int begin, int end, unsigned int /*thread*/)
+	{
+		for (int i = begin; i < end; ++i)
 		{
-			moused = OctTreeManager::GetNearbyShapes(_interactiveShapes[i]);
+			_interactiveShapes[i]->Update(dt);
 		}
+	});
+
+	// Unproject the cursor onto the near and far planes to get a ray into the scene, and let the oct-tree find the closest shape
+	// along it. Only that shape and the one that had the mouse last frame need to hear about it.
+	glm::vec2 mousePos = InputManager::GetMouseDeviceCoords();
+	glm::mat4 invProjMat = glm::inverse(_projMat);
+	glm::vec4 nearPoint = invProjMat * glm::vec4(mousePos.x, mousePos.y, -1.0f, 1.0f);
+	glm::vec4 farPoint = invProjMat * glm::vec4(mousePos.x, mousePos.y, 1.0f, 1.0f);
+	glm::vec3 rayOrigin = glm::vec3(nearPoint) / nearPoint.w;
+	glm::vec3 rayDirection = glm::normalize(glm::vec3(farPoint) / farPoint.w - rayOrigin);
+
+	InteractiveShape* hit = OctTreeManager::RaycastShapes(rayOrigin, rayDirection);
+	if (_mousedShape && _mousedShape != hit && _mousedShape->UpdateMouse(false, rayOrigin, rayDirection))
+	{
+		// The shape being dragged keeps the mouse until it's let go
+		hit = _mousedShape;
+	}
+	else if (hit)
+	{
+		hit->UpdateMouse(true, rayOrigin, rayDirection);
 	}
-	unsigned int size = moused.size();
-	for (unsigned int i = 0; i < size; ++i)
+	_mousedShape = hit;
+
+	if (_mousedShape && _mousedShape->mouseOver())
 	{
-		moused[i]->currentColor() = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+		const std::vector<InteractiveShape*>& moused = OctTreeManager::GetNearbyShapes(_mousedShape);
+		unsigned int size = moused.size();
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			moused[i]->currentColor() = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+		}
 	}
 }
 
-void RenderManager::Draw()
+// Works out the draw calls for everything on screen this frame. After this the frame can be drawn from the draw calls alone,
+// which leaves the shapes and the oct-tree free to change while it is.
+void RenderManager::PrepareDraw()
 {
+	ProfileZone zone("RenderManager::PrepareDraw");
+	_drawCalls.clear();
+	DrawCall drawCall;
 	unsigned int numShapes = _shapes.size();
 	for (unsigned int i = 0; i < numShapes; ++i)
 	{
-		_shapes[i]->Draw(_projMat);
+		if (!_shapes[i]->active()) continue;
+		_shapes[i]->PrepareDraw(_projMat, drawCall);
+		_drawCalls.push_back(drawCall);
 	}
-	numShapes = _interactiveShapes.size();
+	// Only the nodes and shapes that the oct-tree finds inside the view frustum are drawn
+	OctTreeManager::GetVisibleShapes(_projMat, _visibleShapes, _visibleOutlines);
+	numShapes = _visibleOutlines.size();
 	for (unsigned int i = 0; i < numShapes; ++i)
 	{
-		_interactiveShapes[i]->Draw(_projMat);
+		if (!_visibleOutlines[i]->active()) continue;
+		_visibleOutlines[i]->PrepareDraw(_projMat, drawCall);
+		_drawCalls.push_back(drawCall);
+	}
+	numShapes = _visibleShapes.size();
+	for (unsigned int i = 0; i < numShapes; ++i)
+	{
+		if (!_visibleShapes[i]->active()) continue;
+		_visibleShapes[i]->PrepareDraw(_projMat, drawCall);
+		_drawCalls.push_back(drawCall);
+	}
+}
+
+void RenderManager::Draw()
+{
+	ProfileZone zone("RenderManager::Draw");
+	unsigned int numDrawCalls = _drawCalls.size();
+	for (unsigned int i = 0; i < numDrawCalls; ++i)
+	{
+		RenderShape::Draw(_drawCalls[i]);
 	}
 }
 
+// Makes room up front for as many draw calls as a frame can have, so that gathering them doesn't allocate unless the oct-tree
+// grows deeper than it started. Has to be called once the oct-tree is made and the shapes are added.
+void RenderManager::ReserveDrawCalls()
+{
+	unsigned int maxOutlines = OctTreeManager::maxNodes();
+	_visibleShapes.reserve(_interactiveShapes.size());
+	_visibleOutlines.reserve(maxOutlines);
+	_drawCalls.reserve(_shapes.size() + maxOutlines + _interactiveShapes.size());
+}
+
 void RenderManager::DumpData()
 {
 	unsigned int i;
@@ -6,6 +6,7 @@
 struct Transform;
 struct Collider;
 struct Shader;
+struct DrawCall;
 class RenderShape;
 class InteractiveShape;
 
@@ -23,8 +24,12 @@ public:
 
 	static void Update(float dt);
 
+	static void PrepareDraw();
+
 	static void Draw();
 
+	static void ReserveDrawCalls();
+
 	static void DumpData();
 
 	static const std::vector<InteractiveShape*>& interactiveShapes();
@@ -33,6 +38,13 @@ private:
 
 	static std::vector<RenderShape*> _shapes;
 	static std::vector<InteractiveShape*> _interactiveShapes;
+	// What the oct-tree found inside the view frustum this frame
+	static std::vector<InteractiveShape*> _visibleShapes;
+	static std::vector<RenderShape*> _visibleOutlines;
+	// Everything to be drawn this frame, in order. Once these are gathered, drawing doesn't read the shapes or the oct-tree.
+	static std::vector<DrawCall> _drawCalls;
+	// The shape the mouse ray hit last frame, or the shape being dragged
+	static InteractiveShape* _mousedShape;
 
 	static glm::mat4 _projMat;
 
@@ -20,7 +20,11 @@ void RenderShape::Update(float dt)
 {
 	// Update values
 	_transform.position += _transform.linearVelocity * dt;
-	_transform.rotation = glm::slerp(_transform.rotation, _transform.rotation * _transform.angularVelocity, dt);
+	// Most shapes never spin, and slerping toward the rotation they already have would leave it as it is anyway
+	if (_transform.angularVelocity != glm::quat())
+	{
+		_transform.rotation = glm::slerp(_transform.rotation, _transform.rotation * _transform.angularVelocity, dt);
+	}
 
 	_currentColor = _color;
 }
@@ -28,29 +32,47 @@ void RenderShape::Draw(const glm::mat4& viewProjMat)
 {
 	if (_active)
 	{
-		// Apply transforms
-		glm::mat4 translateMat = glm::translate(glm::mat4(), _transform.position);
+		DrawCall drawCall;
+		PrepareDraw(viewProjMat, drawCall);
+		Draw(drawCall);
+	}
+}
+
+// Works out the shape's model matrix and fills in the draw call for it
+void RenderShape::PrepareDraw(const glm::mat4& viewProjMat, DrawCall& drawCall)
+{
+	// Apply transforms
+	glm::mat4 translateMat = glm::translate(glm::mat4(), _transform.position);
 
-		glm::mat4 rotateOriginMat = glm::translate(glm::mat4(), _transform.rotationOrigin);
-		glm::mat4 rotateMat = rotateOriginMat * glm::mat4_cast(_transform.rotation) * glm::inverse(rotateOriginMat);
+	glm::mat4 rotateOriginMat = glm::translate(glm::mat4(), _transform.rotationOrigin);
+	glm::mat4 rotateMat = rotateOriginMat * glm::mat4_cast(_transform.rotation) * glm::inverse(rotateOriginMat);
 
-		glm::mat4 scaleOriginMat = glm::translate(glm::mat4(), _transform.scaleOrigin);
-		glm::mat4 scaleMat = scaleOriginMat * glm::scale(glm::mat4(), _transform.scale) * glm::inverse(scaleOriginMat);
+	glm::mat4 scaleOriginMat = glm::translate(glm::mat4(), _transform.scaleOrigin);
+	glm::mat4 scaleMat = scaleOriginMat * glm::scale(glm::mat4(), _transform.scale) * glm::inverse(scaleOriginMat);
 
-		glm::mat4 *parentModelMat = _transform.parent ? &_transform.parent->modelMat : &glm::mat4();
+	glm::mat4 *parentModelMat = _transform.parent ? &_transform.parent->modelMat : &glm::mat4();
 
-		_transform.modelMat = (*parentModelMat) * (translateMat * rotateMat * scaleMat);
+	_transform.modelMat = (*parentModelMat) * (translateMat * rotateMat * scaleMat);
 
-		glm::mat4 transformMat = viewProjMat * _transform.modelMat;
+	glm::mat4 transformMat = viewProjMat * _transform.modelMat;
 
-		glBindVertexArray(_vao);
+	drawCall.vao = _vao;
+	drawCall.count = _count;
+	drawCall.mode = _mode;
+	drawCall.shader = _shader;
+	drawCall.color = _currentColor;
+	drawCall.transformMat = transformMat;
+}
 
-		glUniformMatrix4fv(_shader.uTransform, 1, GL_FALSE, glm::value_ptr(transformMat));
-		glUniform4fv(_shader.uColor, 1, glm::value_ptr(_currentColor));
+void RenderShape::Draw(const DrawCall& drawCall)
+{
+	glBindVertexArray(drawCall.vao);
 
-		//Make draw call
-		glDrawElements(_mode, _count, GL_UNSIGNED_INT, 0);
-	}
+	glUniformMatrix4fv(drawCall.shader.uTransform, 1, GL_FALSE, glm::value_ptr(drawCall.transformMat));
+	glUniform4fv(drawCall.shader.uColor, 1, glm::value_ptr(drawCall.color));
+
+	//Make draw call
+	glDrawElements(drawCall.mode, drawCall.count, GL_UNSIGNED_INT, 0);
 }
 
 const glm::vec4& RenderShape::color()
@@ -51,6 +51,18 @@ struct Shader
 	}
 };
 
+// Everything needed to draw a shape once, worked out ahead of time so that the shape itself doesn't have to be touched when the
+// draw call is finally made
+struct DrawCall
+{
+	GLint vao;
+	GLsizei count;
+	GLenum mode;
+	Shader shader;
+	glm::vec4 color;
+	glm::mat4 transformMat;
+};
+
 class RenderShape
 {
 public:
@@ -59,6 +71,8 @@ public:
 
 	void Update(float dt);
 	void Draw(const glm::mat4& viewProjMat);
+	void PrepareDraw(const glm::mat4& viewProjMat, DrawCall& drawCall);
+	static void Draw(const DrawCall& drawCall);
 
 	const glm::vec4& color();
 	glm::vec4& currentColor();
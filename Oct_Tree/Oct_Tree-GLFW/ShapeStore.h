@@ -0,0 +1,82 @@
+#pragma once
+#include <GLM\glm.hpp>
+#include <vector>
+
+class InteractiveShape;
+
+// Names a shape's slot in the shape store. A shape keeps the same handle for as long as it's in the store, and the slots of
+// removed shapes are handed out again to new ones.
+typedef unsigned int ShapeHandle;
+
+enum ShapeFlags
+{
+	// The slot holds a shape
+	Shape_Live = 1
+};
+
+// A shape's collider as a box in world space
+struct ShapeBox
+{
+	glm::vec3 min;
+	glm::vec3 max;
+};
+
+// Keeps the position, size, velocity and mass of every interactive shape in arrays of plain floats, one array for each value and
+// indexed by handle, so that the trees and the update loop can run through them without going through each shape's transform.
+// x, y and z are the center of the shape's collider rather than the shape's position, and the half sizes are half of the
+// collider's. The store owns these values, and each shape copies its position back out into its transform when it updates.
+// Each shape's box is worked out once whenever it moves, so that the trees can test it against their nodes without adding the
+// half sizes to the center over and over.
+class ShapeStore
+{
+public:
+
+	static ShapeHandle AddShape(InteractiveShape* shape, const glm::vec3& center, const glm::vec3& halfSize);
+
+	static void RemoveShape(ShapeHandle handle);
+
+	static void SetBounds(const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+	static void Integrate(float dt);
+
+	static void UpdateBox(ShapeHandle handle);
+
+	static void DumpData();
+
+	static unsigned int size();
+
+	static std::vector<float>& x();
+	static std::vector<float>& y();
+	static std::vector<float>& z();
+	static std::vector<float>& halfWidth();
+	static std::vector<float>& halfHeight();
+	static std::vector<float>& halfDepth();
+	static std::vector<float>& velocityX();
+	static std::vector<float>& velocityY();
+	static std::vector<float>& velocityZ();
+	static std::vector<float>& mass();
+	static std::vector<ShapeBox>& boxes();
+	static std::vector<unsigned char>& flags();
+	static std::vector<InteractiveShape*>& shapes();
+
+private:
+
+	static std::vector<float> _x;
+	static std::vector<float> _y;
+	static std::vector<float> _z;
+	static std::vector<float> _halfWidth;
+	static std::vector<float> _halfHeight;
+	static std::vector<float> _halfDepth;
+	static std::vector<float> _velocityX;
+	static std::vector<float> _velocityY;
+	static std::vector<float> _velocityZ;
+	static std::vector<float> _mass;
+	static std::vector<ShapeBox> _boxes;
+	static std::vector<unsigned char> _flags;
+	static std::vector<InteractiveShape*> _shapes;
+	// Slots left empty by removed shapes
+	static std::vector<ShapeHandle> _freeHandles;
+	// The walls that shapes bounce off of
+	static glm::vec3 _boundsMin;
+	static glm::vec3 _boundsMax;
+};
@@ -31,9 +31,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *	- This class handles all user input from the mouse and keyboard.
 *
 *	3) OctTreeManager
-*	- This class maintains an array of references to InteractiveShapes and every frame divides them into an oct-tree structure. It handles the
+*	- This class maintains an array of references to InteractiveShapes and every frame moves the ones that have changed nodes within an oct-tree
+*	structure. Nodes are only made where they are needed and are looked up in a hash table by their position in the tree. It handles the
 *	generation and updating of this information based on the locations of the interactive shapes. Furthermore, it maintains references and updates
-*	an array of division line RenderShapes that serve to more clearly depict what the current state of the quad tree is.
+*	an array of division line RenderShapes that serve to more clearly depict what the current state of the quad tree is. In unbounded mode the root grows and
+*	shrinks to fit the shapes rather than keeping the bounds it was given. In point cloud mode
+*	each node also keeps a few sample shapes and the average of everything below it, for level of detail queries.
+*
+*	4) JobManager
+*	- This class owns a set of worker threads and splits large batches of work, such as building the eight octants of the oct-tree and updating every shape, across them.
+*	It also keeps one more thread for running a single task in the background, such as the tree update of a pipelined frame.
 *
 *	RenderShape
 *	- Holds the instance data for a shape that can be rendered to the screen. This includes a transform, a vao, a shader, the drawing
@@ -43,6 +50,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *	- Inherits from RenderShape, possessing all the same properties. Additionally, it has a collider and can use it to check collisions against
 *	world boundries, other colliders, and the cursor.
 *
+*	ShapeStore
+*	- Holds the position, size, velocity and flags of every InteractiveShape in separate arrays of plain values, indexed by a handle that each
+*	shape keeps. It moves every shape along its velocity and off the walls each frame, and the oct-tree reads its arrays directly.
+*
+*	AllocTracker
+*	- Counts the heap allocations made during each stage of a frame, and in strict mode stops the program at any made once it has warmed up.
+*
+*	Profiler
+*	- Times named zones of each frame on every thread, and writes them out as a Chrome trace and a report of how long each zone takes.
+*
+*	TreeStats
+*	- Describes the shape of a tree and counts what it has done, such as rebuilds and splits, for spotting a tree that has gone wrong.
+*
+*	NodePool
+*	- Hands out the tree's nodes from a few large blocks of memory, so that they sit next to each other and can all be freed at once.
+*
 *	Init_Shader
 *	- Contains static functions for loading, compiling and linking shaders.
 *
@@ -58,9 +81,32 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "RenderManager.h"
 #include "InputManager.h"
 #include "OctTreeManager.h"
+#include "JobManager.h"
+#include "ShapeStore.h"
+#include "AllocTracker.h"
+#include "Profiler.h"
 
 GLFWwindow* window;
 
+// While frames are pipelined, the oct-tree for the next frame is updated on the job manager's background thread while the current
+// frame is drawn. Drawing only reads the draw calls gathered beforehand, so the two never touch the same data, and the update is
+// waited on at the start of the next frame before anything reads the tree again.
+bool pipelineFrames = true;
+
+// With strict allocations on, any heap allocation made during a frame once the program has warmed up stops it, and every node the
+// oct-tree can have is made up front so that the tree reaching a size it hasn't been before doesn't allocate. Either way the
+// allocations made in each stage of the last frame can be looked at through the AllocTracker.
+bool strictAllocations = false;
+
+// With profiling on, each frame and the work done during it is timed on every thread. When the program closes, the timings are
+// written to trace.json, which can be opened in chrome://tracing, and a report of how long each zone took goes to the console.
+bool profileFrames = false;
+
+// With tree stats on, a line describing the shape of the tree and what it did during the frame is written to the console every
+// frame. The same stats can be asked for at any time between tree updates.
+bool dumpTreeStats = false;
+TreeStats treeStats;
+
 GLuint vertexShader;
 GLuint fragmentShader;
 GLuint shaderProgram;
@@ -193,9 +239,18 @@ void init()
 	time(&timer);
 	srand((unsigned int)timer);
 
+	ShapeStore::SetBounds(glm::vec3(-1.337f, -1.0f, -5.0f), glm::vec3(1.337f, 1.0f, -3.0f));
+
 	RenderManager::GenerateShapes(shader, vao0, 100, GL_TRIANGLES, 36);
 
 	InputManager::Init(window);
+
+	Profiler::SetEnabled(profileFrames);
+	Profiler::NameThread("Main");
+
+	JobManager::Init();
+
+	AllocTracker::SetStrict(strictAllocations);
 	
 	OctTreeManager::InitOctTree(-1.337f, 1.337f, 1.0f, -1.0f, -3.0f, -5.0f, 4, 2, RenderShape(vao1, 24, GL_LINES, shader, glm::vec4(0.0f, 1.0f, 0.3f, 1.0f)));
 	unsigned int shapesSize = RenderManager::interactiveShapes().size();
@@ -203,10 +258,19 @@ void init()
 	{
 		OctTreeManager::AddShape(RenderManager::interactiveShapes()[i]);
 	}
+	RenderManager::ReserveDrawCalls();
+	if (strictAllocations)
+	{
+		OctTreeManager::ReserveNodes();
+	}
 }
 
 void step()
 {
+	ProfileZone frameZone("Frame");
+	AllocTracker::BeginFrame();
+	AllocTracker::BeginStage("Input");
+
 	// Clear to black
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -217,18 +281,55 @@ void step()
 	float dt = glfwGetTime();
 	glfwSetTime(0.0f);
 
-	OctTreeManager::UpdateOctTree();
+	// If the last frame started an update while it was drawing, that update already brought the tree up to date for this frame
+	AllocTracker::BeginStage("Tree");
+	if (JobManager::taskPending())
+	{
+		JobManager::WaitTask();
+	}
+	else
+	{
+		OctTreeManager::UpdateOctTree();
+	}
 
+	AllocTracker::BeginStage("Update");
 	RenderManager::Update(dt);
 
+	AllocTracker::BeginStage("Prepare");
+	RenderManager::PrepareDraw();
+
+	// The tree isn't touched again until the next update starts, so this frame's stats are complete
+	if (dumpTreeStats)
+	{
+		OctTreeManager::GetStats(treeStats);
+		treeStats.Write(std::cout);
+		OctTreeManager::ResetStats();
+	}
+
+	if (pipelineFrames)
+	{
+		JobManager::StartTask(OctTreeManager::UpdateOctTree);
+	}
+
+	AllocTracker::BeginStage("Draw");
 	RenderManager::Draw();
 
 	// Swap buffers
 	glfwSwapBuffers(window);
+
+	AllocTracker::EndFrame();
 }
 
 void cleanUp()
 {
+	JobManager::WaitTask();
+
+	if (profileFrames)
+	{
+		if (!Profiler::WriteChromeTrace("trace.json")) std::cerr << "Could not write trace.json" << std::endl;
+		Profiler::WriteReport(std::cout);
+	}
+
 	glDeleteProgram(shaderProgram);
 	glDeleteShader(vertexShader);
 	glDeleteShader(fragmentShader);
@@ -243,6 +344,10 @@ void cleanUp()
 
 	OctTreeManager::DumpData();
 
+	JobManager::DumpData();
+
+	ShapeStore::DumpData();
+
 	glfwTerminate();
 }
 
@@ -0,0 +1,125 @@
+#include "AllocTracker.h"
+#include <cstdlib>
+#include <new>
+#include <iostream>
+
+// Frames before this are still filling buffers for the first time, so strict mode lets them allocate
+static const unsigned int WARMUP_FRAMES = 120;
+
+std::atomic<unsigned long long> AllocTracker::_allocations(0);
+std::atomic<unsigned long long> AllocTracker::_bytes(0);
+AllocStage AllocTracker::_stages[AllocTracker::MAX_STAGES];
+unsigned int AllocTracker::_numStages = 0;
+bool AllocTracker::_stageOpen = false;
+unsigned long long AllocTracker::_stageAllocations = 0;
+unsigned long long AllocTracker::_stageBytes = 0;
+unsigned int AllocTracker::_frame = 0;
+bool AllocTracker::_strict = false;
+
+// Every new in the program comes through here, so these have to stay cheap and must not allocate themselves
+void* operator new(size_t size)
+{
+	AllocTracker::RecordAllocation(size);
+	void* memory = malloc(size > 0 ? size : 1);
+	if (!memory) throw std::bad_alloc();
+	return memory;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* memory)
+{
+	free(memory);
+}
+
+void operator delete[](void* memory)
+{
+	free(memory);
+}
+
+// The sized forms are what compilers that know the size being freed call instead. It isn't needed to free the memory.
+void operator delete(void* memory, size_t)
+{
+	free(memory);
+}
+
+void operator delete[](void* memory, size_t)
+{
+	free(memory);
+}
+
+void AllocTracker::RecordAllocation(size_t bytes)
+{
+	_allocations.fetch_add(1, std::memory_order_relaxed);
+	_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void AllocTracker::BeginFrame()
+{
+	_numStages = 0;
+	_stageOpen = false;
+}
+
+// Ends the stage that's open, if there is one, and starts counting for the next
+void AllocTracker::BeginStage(const char* name)
+{
+	EndStage();
+	if (_numStages == MAX_STAGES) return;
+
+	_stages[_numStages].name = name;
+	_stages[_numStages].allocations = 0;
+	_stages[_numStages].bytes = 0;
+	_stageAllocations = _allocations.load(std::memory_order_relaxed);
+	_stageBytes = _bytes.load(std::memory_order_relaxed);
+	_stageOpen = true;
+}
+
+void AllocTracker::EndFrame()
+{
+	EndStage();
+	++_frame;
+}
+
+void AllocTracker::SetStrict(bool strict)
+{
+	_strict = strict;
+}
+
+void AllocTracker::EndStage()
+{
+	if (!_stageOpen) return;
+	_stageOpen = false;
+
+	AllocStage& stage = _stages[_numStages++];
+	stage.allocations = (unsigned int)(_allocations.load(std::memory_order_relaxed) - _stageAllocations);
+	stage.bytes = _bytes.load(std::memory_order_relaxed) - _stageBytes;
+
+	if (_strict && _frame >= WARMUP_FRAMES && stage.allocations > 0)
+	{
+		std::cerr << "Frame " << _frame << " allocated " << stage.allocations << " times (" << stage.bytes << " bytes) during " << stage.name << std::endl;
+		abort();
+	}
+}
+
+unsigned int AllocTracker::numStages()
+{
+	return _numStages;
+}
+
+const AllocStage& AllocTracker::stage(unsigned int index)
+{
+	return _stages[index];
+}
+
+unsigned long long AllocTracker::totalAllocations()
+{
+	return _allocations.load(std::memory_order_relaxed);
+}
+
+unsigned long long AllocTracker::totalBytes()
+{
+	return _bytes.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+// What was allocated during one stage of a frame
+struct AllocStage
+{
+	const char* name;
+	unsigned int allocations;
+	unsigned long long bytes;
+};
+
+// Counts every heap allocation the program makes, on any thread, by standing in for the global operator new. Each frame is
+// split into named stages, and what each stage of the last frame allocated is kept so it can be looked at. Work that runs in the
+// background is counted against whichever stage is open while it runs. In strict mode an allocation in any stage once the
+// program has warmed up aborts the program, even in release builds, since by then every buffer should have grown as large as
+// the frames need.
+class AllocTracker
+{
+public:
+
+	static void RecordAllocation(size_t bytes);
+
+	static void BeginFrame();
+
+	static void BeginStage(const char* name);
+
+	static void EndFrame();
+
+	static void SetStrict(bool strict);
+
+	static unsigned int numStages();
+
+	static const AllocStage& stage(unsigned int index);
+
+	static unsigned long long totalAllocations();
+
+	static unsigned long long totalBytes();
+
+private:
+
+	static void EndStage();
+
+	static const unsigned int MAX_STAGES = 16;
+
+	static std::atomic<unsigned long long> _allocations;
+	static std::atomic<unsigned long long> _bytes;
+	// The stages of the frame so far, and the totals when the open one began
+	static AllocStage _stages[MAX_STAGES];
+	static unsigned int _numStages;
+	static bool _stageOpen;
+	static unsigned long long _stageAllocations;
+	static unsigned long long _stageBytes;
+	static unsigned int _frame;
+	static bool _strict;
+};
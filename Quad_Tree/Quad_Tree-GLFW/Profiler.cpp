@@ -0,0 +1,181 @@
+#include "Profiler.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+
+Profiler::ThreadLog* Profiler::_logs[Profiler::MAX_THREADS];
+std::atomic<unsigned int> Profiler::_numLogs(0);
+std::mutex Profiler::_mutex;
+bool Profiler::_enabled = false;
+std::chrono::high_resolution_clock::time_point Profiler::_epoch = std::chrono::high_resolution_clock::now();
+
+// Orders events by zone name first and then by how long they took, so that each zone's events end up together and sorted
+static bool CompareEvents(const ProfileEvent& a, const ProfileEvent& b)
+{
+	int order = strcmp(a.name, b.name);
+	return order != 0 ? order < 0 : a.duration < b.duration;
+}
+
+void Profiler::SetEnabled(bool enabled)
+{
+	_enabled = enabled;
+}
+
+bool Profiler::enabled()
+{
+	return _enabled;
+}
+
+// Gives the calling thread a name to show in the trace, and makes its ring if it doesn't have one yet. Threads that are named
+// when they start have their ring made up front rather than during their first frame.
+void Profiler::NameThread(const char* name)
+{
+	if (!_enabled) return;
+
+	ThreadLog* log = GetLog();
+	if (log) log->name = name;
+}
+
+void Profiler::Record(const char* name, long long start, long long end)
+{
+	ThreadLog* log = GetLog();
+	if (!log) return;
+
+	ProfileEvent& event = log->events[log->written % RING_SIZE];
+	event.name = name;
+	event.start = start;
+	event.duration = end - start;
+	++log->written;
+}
+
+long long Profiler::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - _epoch).count();
+}
+
+// Writes every event still in the rings as a complete event ("ph":"X") in the Chrome trace event format, with one row for each
+// thread. Times in the format are in microseconds. No zones may be recorded while this runs, so any background work has to be
+// waited on first. Returns false if the file couldn't be opened.
+bool Profiler::WriteChromeTrace(const char* path)
+{
+	std::ofstream file(path);
+	if (!file) return false;
+
+	file << std::fixed << std::setprecision(3);
+	file << "{\"traceEvents\":[";
+	bool first = true;
+	std::vector<ProfileEvent> events;
+	unsigned int numLogs = _numLogs.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < numLogs; ++i)
+	{
+		file << (first ? "\n" : ",\n");
+		first = false;
+		file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << i << ",\"args\":{\"name\":\"" << _logs[i]->name << "\"}}";
+
+		GetEvents(_logs[i], events);
+		unsigned int numEvents = events.size();
+		for (unsigned int j = 0; j < numEvents; ++j)
+		{
+			file << ",\n{\"name\":\"" << events[j].name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << i
+				<< ",\"ts\":" << events[j].start / 1000.0 << ",\"dur\":" << events[j].duration / 1000.0 << "}";
+		}
+	}
+	file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+	return file.good();
+}
+
+// Writes a table with a row for each zone, across every thread, giving how many times it was recorded and the mean, median,
+// 90th and 99th percentile and longest times it took, in milliseconds. Percentiles are the nearest recorded time at or below
+// the percentile. The same as for the trace, no zones may be recorded while this runs.
+void Profiler::WriteReport(std::ostream& out)
+{
+	std::vector<ProfileEvent> events;
+	std::vector<ProfileEvent> threadEvents;
+	unsigned int numLogs = _numLogs.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < numLogs; ++i)
+	{
+		GetEvents(_logs[i], threadEvents);
+		events.insert(events.end(), threadEvents.begin(), threadEvents.end());
+	}
+	std::sort(events.begin(), events.end(), CompareEvents);
+
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	out << std::left << std::setw(36) << "Zone" << std::right << std::setw(8) << "Count" << std::setw(10) << "Mean"
+		<< std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "Max" << std::endl;
+	out << std::fixed << std::setprecision(3);
+
+	unsigned int numEvents = events.size();
+	unsigned int start = 0;
+	while (start < numEvents)
+	{
+		unsigned int end = start + 1;
+		long long total = events[start].duration;
+		while (end < numEvents && strcmp(events[end].name, events[start].name) == 0)
+		{
+			total += events[end].duration;
+			++end;
+		}
+
+		unsigned int count = end - start;
+		const ProfileEvent* zone = &events[start];
+		out << std::left << std::setw(36) << zone->name << std::right << std::setw(8) << count
+			<< std::setw(10) << total / (count * 1000000.0)
+			<< std::setw(10) << zone[(count - 1) * 50 / 100].duration / 1000000.0
+			<< std::setw(10) << zone[(count - 1) * 90 / 100].duration / 1000000.0
+			<< std::setw(10) << zone[(count - 1) * 99 / 100].duration / 1000000.0
+			<< std::setw(10) << zone[count - 1].duration / 1000000.0 << std::endl;
+		start = end;
+	}
+
+	out.flags(flags);
+	out.precision(precision);
+}
+
+// Forgets every event recorded so far. The threads keep their rings and names. As with writing them out, no zones may be
+// recorded while this runs.
+void Profiler::Clear()
+{
+	unsigned int numLogs = _numLogs.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < numLogs; ++i)
+	{
+		_logs[i]->written = 0;
+	}
+}
+
+// Finds the calling thread's log, making it the first time the thread asks. Returns nullptr once there are too many threads.
+Profiler::ThreadLog* Profiler::GetLog()
+{
+	std::thread::id id = std::this_thread::get_id();
+	unsigned int numLogs = _numLogs.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < numLogs; ++i)
+	{
+		if (_logs[i]->id == id) return _logs[i];
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	numLogs = _numLogs.load(std::memory_order_relaxed);
+	if (numLogs == MAX_THREADS) return nullptr;
+
+	ThreadLog* log = new ThreadLog();
+	log->id = id;
+	log->name = "Thread";
+	log->events.resize(RING_SIZE);
+	log->written = 0;
+	_logs[numLogs] = log;
+	_numLogs.store(numLogs + 1, std::memory_order_release);
+	return log;
+}
+
+// Copies a thread's events out of its ring, oldest first
+void Profiler::GetEvents(const ThreadLog* log, std::vector<ProfileEvent>& events)
+{
+	events.clear();
+	unsigned long long first = log->written > RING_SIZE ? log->written - RING_SIZE : 0;
+	for (unsigned long long i = first; i < log->written; ++i)
+	{
+		events.push_back(log->events[i % RING_SIZE]);
+	}
+}
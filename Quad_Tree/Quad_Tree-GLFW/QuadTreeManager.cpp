@@ -2,21 +2,29 @@
 #include "InteractiveShape.h"
 #include "RenderShape.h"
 #include "RenderManager.h"
+#include "ShapeStore.h"
+#include "Profiler.h"
 
 std::vector<QuadTreeNode*> QuadTreeManager::_quadTree = std::vector<QuadTreeNode*>();
-std::vector<InteractiveShape*> QuadTreeManager::_shapes = std::vector<InteractiveShape*>();
+std::vector<ShapeHandle> QuadTreeManager::_shapes = std::vector<ShapeHandle>();
+NodePool<QuadTreeNode> QuadTreeManager::_nodePool;
+std::vector<QuadTreeShapeBlock> QuadTreeManager::_shapeBlocks = std::vector<QuadTreeShapeBlock>();
+unsigned int QuadTreeManager::_usedBlocks = 0;
+TreeStats QuadTreeManager::_stats;
 unsigned int QuadTreeManager::_maxDepth = 0;
 unsigned int QuadTreeManager::_maxPerNode = 0;
 RenderShape QuadTreeManager::_outlineTemplate;
 
 // When the quad-tree manager is initialized, it instantiates the entire possible tree to avoid having to do a bunch of 
-// time wasting news and deletes during runtime.
+// time wasting news and deletes during runtime. Since the size of the tree is known up front, every node comes out of
+// a single block of the node pool.
 void QuadTreeManager::InitQuadTree(float left, float right, float top, float bottom, unsigned int maxDepth, unsigned int maxPerNode, RenderShape outlineTemplate)
 {
 	_maxPerNode = maxPerNode;
 	_maxDepth = maxDepth;
 	_outlineTemplate = outlineTemplate;
 	_quadTree.resize(GetDepthIndex(maxDepth));
+	_nodePool.Init(_quadTree.size());
 	_quadTree[0] = InitNode(0, 0, 0, left, right, top, bottom);
 	int maxI = GetDepthIndex(maxDepth - 1);
 	for (int i = 0; i < maxI; ++i)
@@ -26,9 +34,13 @@ void QuadTreeManager::InitQuadTree(float left, float right, float top, float bot
 }
 
 // When updateing the tree, the manager goes through and deactivates every node in the tree and then reactivates the root.
-// It then goes through the entire array of interactive shapes and adds them back into the tree. 
+// It then goes through the entire array of interactive shapes and adds them back into the tree. The shape blocks from the
+// last update are all handed out again, so the update makes no allocations unless it needs more blocks than ever before.
 void QuadTreeManager::UpdateQuadtree()
 {
+	ProfileZone zone("QuadTreeManager::UpdateQuadtree");
+	++_stats.rebuilds;
+	_usedBlocks = 0;
 	unsigned int treeSize = _quadTree.size();
 	for (unsigned int i = 0; i < treeSize; ++i)
 	{
@@ -44,31 +56,30 @@ void QuadTreeManager::UpdateQuadtree()
 
 void QuadTreeManager::AddShape(InteractiveShape* shape)
 {
-	_shapes.push_back(shape);
+	_shapes.push_back(shape->handle());
 }
 
-// When the program ends, the manager has to go through and delete all of the nodes of quad tree that it instantiated
-// during the init function.
+// When the program ends, the manager frees all of the nodes of the quad tree that it instantiated during the init function.
+// They all came out of the node pool, so they go with it at once.
 void QuadTreeManager::DumpData()
 {
-	int i;
-	while ((i = _quadTree.size()) > 0)
-	{
-		delete _quadTree[i - 1];
-		_quadTree.pop_back(); 
-	}
+	_nodePool.Clear();
+	_quadTree.clear();
+	_shapeBlocks.clear();
+	_usedBlocks = 0;
 }
 
 // Retrieves all the shapes that share a node with the shape passed in. It uses a method similar to when a shape is being
-// added to the tree. When it gets to the lowest node that the argument shape collides with, it returns the array of shapes
+// added to the tree. When it gets to the lowest node that the argument shape collides with, it returns the shapes
 // associated with that node.
-const std::vector<InteractiveShape*>& QuadTreeManager::GetNearbyShapes(InteractiveShape* shape)
+ShapeRange QuadTreeManager::GetNearbyShapes(InteractiveShape* shape)
 {
+	ShapeHandle handle = shape->handle();
 	unsigned int treeSize = _quadTree.size();
 	for (unsigned int i = 0; i < treeSize;)
 	{
 		QuadTreeNode* currentNode = _quadTree[i];
-		int result = CheckShapeNodeCollide(shape, currentNode);
+		int result = CheckShapeNodeCollide(handle, currentNode);
 		// No collision
 		if (result == 0)
 		{
@@ -80,7 +91,9 @@ const std::vector<InteractiveShape*>& QuadTreeManager::GetNearbyShapes(Interacti
 		{
 			if (currentNode->depth != 0)
 			{
-				return _quadTree[currentNode->parent]->shapes;
+				++_stats.nearbyQueries;
+				_stats.nearbyCandidates += _quadTree[currentNode->parent]->numShapes;
+				return GetShapes(_quadTree[currentNode->parent]);
 			}
 			else
 			{
@@ -94,7 +107,9 @@ const std::vector<InteractiveShape*>& QuadTreeManager::GetNearbyShapes(Interacti
 
 			if (!currentNode->hasChildren)
 			{
-				return currentNode->shapes;
+				++_stats.nearbyQueries;
+				_stats.nearbyCandidates += currentNode->numShapes;
+				return GetShapes(currentNode);
 			}
 			else
 			{
@@ -102,18 +117,41 @@ const std::vector<InteractiveShape*>& QuadTreeManager::GetNearbyShapes(Interacti
 			}
 		}
 	}
+	return ShapeRange();
+}
+
+// Fills in the stats from the running counts and the nodes that are active. Every update rebuilds the whole tree, so each one
+// counts as a rebuild. Shapes that only partly fit in a node are held by its parent, so any shapes held by a node with children
+// are straddling shapes. This reads the tree, so it mustn't be called while an update is running.
+void QuadTreeManager::GetStats(TreeStats& stats)
+{
+	stats = _stats;
+	stats.ClearNodes();
+	unsigned int treeSize = _quadTree.size();
+	for (unsigned int i = 0; i < treeSize; ++i)
+	{
+		QuadTreeNode* node = _quadTree[i];
+		if (!node->active) continue;
+		stats.CountNode(node->depth, node->numShapes);
+		if (node->hasChildren) stats.straddlingShapes += node->numShapes;
+	}
+}
+
+void QuadTreeManager::ResetStats()
+{
+	_stats.Reset();
 }
 
 // Adds the given shape to the quad tree beginnng at the node index passed in. Shapes are added to the first node that with which they have a successful collision
 // If they only have a partial collision, they are added to that node's parent. If a node is at the bottom of the activated tree, and it exceeds the max number
 // of shapes, then each of it's shapes are added back into the tree, passing that node's index as the starting node and that node's children are activated. 
-void QuadTreeManager::AddShape(InteractiveShape* shape, int startingNode)
+void QuadTreeManager::AddShape(ShapeHandle handle, int startingNode)
 {
 	unsigned int treeSize = _quadTree.size();
 	for (unsigned int i = startingNode; i < treeSize;)
 	{
 		QuadTreeNode* currentNode = _quadTree[i];
-		int result = CheckShapeNodeCollide(shape, currentNode);
+		int result = CheckShapeNodeCollide(handle, currentNode);
 		// No collision
 		if (result == 0)
 		{
@@ -127,7 +165,7 @@ void QuadTreeManager::AddShape(InteractiveShape* shape, int startingNode)
 			// parent nodes, any partial collisions with the root have to be considered full collisions. 
 			if (currentNode->depth != 0)
 			{
-				_quadTree[currentNode->parent]->shapes.push_back(shape);
+				PushShape(_quadTree[currentNode->parent], handle);
 				break;
 			}
 			else
@@ -139,18 +177,27 @@ void QuadTreeManager::AddShape(InteractiveShape* shape, int startingNode)
 		// Full collision
 		if (result == 2)
 		{
-			if (currentNode->shapes.size() >= _maxPerNode  && currentNode->depth < _maxDepth)
+			if (currentNode->numShapes >= _maxPerNode  && currentNode->depth < _maxDepth)
 			{
 				if (!currentNode->hasChildren)
 				{
 					ActivateChildren(currentNode);
-					// Add all the shapes in the current node to the current node's children
-					std::vector<InteractiveShape*> shapesTemp = currentNode->shapes;
-					currentNode->shapes.clear();
-					unsigned int size = shapesTemp.size();
+					// Add all the shapes in the current node to the current node's children. The node lets go of its blocks,
+					// but they aren't handed out again until the next update, so they can still be read from here.
+					int block = currentNode->firstBlock;
+					unsigned int size = currentNode->numShapes;
+					currentNode->firstBlock = -1;
+					currentNode->lastBlock = -1;
+					currentNode->numShapes = 0;
+					++_stats.subdivisions;
+					_stats.subdivisionShapes += size;
 					for (unsigned int j = 0; j < size; ++j)
 					{
-						AddShape(shapesTemp[j], currentNode->children[0]);
+						AddShape(_shapeBlocks[block].shapes[j % QuadTreeShapeBlock::SIZE], currentNode->children[0]);
+						if (j % QuadTreeShapeBlock::SIZE == QuadTreeShapeBlock::SIZE - 1)
+						{
+							block = _shapeBlocks[block].next;
+						}
 					}
 				}
 				i = currentNode->children[0];
@@ -159,7 +206,7 @@ void QuadTreeManager::AddShape(InteractiveShape* shape, int startingNode)
 			{
 				if (!currentNode->hasChildren)
 				{
-					currentNode->shapes.push_back(shape);
+					PushShape(currentNode, handle);
 					break;
 				}
 				else
@@ -172,17 +219,18 @@ void QuadTreeManager::AddShape(InteractiveShape* shape, int startingNode)
 }
 
 // Just an AABB collision
-int QuadTreeManager::CheckShapeNodeCollide(InteractiveShape* shape, QuadTreeNode* node)
+int QuadTreeManager::CheckShapeNodeCollide(ShapeHandle handle, QuadTreeNode* node)
 {
 	// 0 = no collision
 	// 1 = partial collision
 	// 2 = full collision
 	int colStatus = 0;
-	Collider col = shape->collider();
-	float dTop = node->top - (col.y + col.height / 2.0f);
-	float dBot = node->bottom - (col.y - col.height / 2.0f);
-	float dLeft = node->left - (col.x - col.width / 2.0f);
-	float dRight = node->right - (col.x + col.width / 2.0f);
+	// The shape's box was already worked out by the shape store when the shape last moved
+	const ShapeBox& box = ShapeStore::boxes()[handle];
+	float dTop = node->top - box.max.y;
+	float dBot = node->bottom - box.min.y;
+	float dLeft = node->left - box.min.x;
+	float dRight = node->right - box.max.x;
 	float width = node->right - node->left;
 	float height = node->top - node->bottom;
 	colStatus += abs(dTop) < height && abs(dBot) < height && abs(dRight) < width && abs(dLeft) < width;
@@ -204,7 +252,10 @@ void QuadTreeManager::InitChildren(int nodeIndex)
 
 QuadTreeNode* QuadTreeManager::InitNode(int depth, int parentIndex, int childNum, float left, float right, float top, float bottom)
 {
-	QuadTreeNode* node = new QuadTreeNode();
+	QuadTreeNode* node = _nodePool.Create();
+	node->firstBlock = -1;
+	node->lastBlock = -1;
+	node->numShapes = 0;
 	node->active = false;
 	node->hasChildren = false;
 	node->depth = depth;
@@ -229,6 +280,37 @@ QuadTreeNode* QuadTreeManager::InitNode(int depth, int parentIndex, int childNum
 	return node;
 }
 
+// Adds a shape to the end of the node's list, starting a new block when the last one is full
+void QuadTreeManager::PushShape(QuadTreeNode* node, ShapeHandle handle)
+{
+	unsigned int pos = node->numShapes % QuadTreeShapeBlock::SIZE;
+	if (pos == 0)
+	{
+		if (_usedBlocks == _shapeBlocks.size())
+		{
+			_shapeBlocks.push_back(QuadTreeShapeBlock());
+		}
+		int block = _usedBlocks++;
+		_shapeBlocks[block].next = -1;
+		if (node->lastBlock >= 0)
+		{
+			_shapeBlocks[node->lastBlock].next = block;
+		}
+		else
+		{
+			node->firstBlock = block;
+		}
+		node->lastBlock = block;
+	}
+	_shapeBlocks[node->lastBlock].shapes[pos] = handle;
+	++node->numShapes;
+}
+
+ShapeRange QuadTreeManager::GetShapes(QuadTreeNode* node)
+{
+	return ShapeRange(_shapeBlocks.empty() ? nullptr : &_shapeBlocks[0], node->firstBlock, node->numShapes);
+}
+
 void QuadTreeManager::ActivateChildren(QuadTreeNode* parent)
 {
 	parent->hasChildren = true;
@@ -241,7 +323,9 @@ void QuadTreeManager::ActivateChildren(QuadTreeNode* parent)
 void QuadTreeManager::DeactivateNode(QuadTreeNode* node)
 {
 	node->active = false;
-	node->shapes.clear();
+	node->firstBlock = -1;
+	node->lastBlock = -1;
+	node->numShapes = 0;
 	node->outline->transform().position.x = 10000.0f;
 	node->outline->transform().position.y = 10000.0f;
 }
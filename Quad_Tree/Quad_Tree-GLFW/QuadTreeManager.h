@@ -1,12 +1,30 @@
 #pragma once
 #include <vector>
+#include "NodePool.h"
+#include "TreeStats.h"
+#include "ShapeStore.h"
 
 class InteractiveShape; 
 class RenderShape;
 
+// A piece of a node's list of shapes. Every node's blocks come out of one buffer that is emptied each time the tree is
+// updated, and the blocks of a node are chained together by their index in that buffer. Blocks hold handles, so building the
+// tree only ever reads the shape store's arrays.
+struct QuadTreeShapeBlock
+{
+	static const unsigned int SIZE = 8;
+
+	ShapeHandle shapes[SIZE];
+	// The next block of the same node, or -1 for the last one
+	int next;
+};
+
 struct QuadTreeNode
 {
-	std::vector<InteractiveShape*> shapes;
+	// The first and last blocks of this node's shapes, or -1 if it has none
+	int firstBlock;
+	int lastBlock;
+	unsigned int numShapes;
 	RenderShape* outline;
 	int children[4];
 	int parent;
@@ -20,6 +38,54 @@ struct QuadTreeNode
 	float bottom;
 };
 
+// A view of the shapes in a single node, read straight out of the node's blocks. Nothing is copied, so the view is only valid
+// until the tree is next updated. Each handle is only looked up in the shape store as the iterator hands it out.
+class ShapeRange
+{
+public:
+
+	class iterator
+	{
+	public:
+		iterator(const QuadTreeShapeBlock* blocks, int block, unsigned int remaining) : _blocks(blocks), _block(block), _pos(0), _remaining(remaining) {}
+
+		InteractiveShape* operator*() const { return ShapeStore::shapes()[_blocks[_block].shapes[_pos]]; }
+		ShapeHandle handle() const { return _blocks[_block].shapes[_pos]; }
+		iterator& operator++()
+		{
+			--_remaining;
+			if (++_pos == QuadTreeShapeBlock::SIZE)
+			{
+				_block = _blocks[_block].next;
+				_pos = 0;
+			}
+			return *this;
+		}
+		bool operator==(const iterator& other) const { return _remaining == other._remaining; }
+		bool operator!=(const iterator& other) const { return _remaining != other._remaining; }
+
+	private:
+
+		const QuadTreeShapeBlock* _blocks;
+		int _block;
+		unsigned int _pos;
+		unsigned int _remaining;
+	};
+
+	ShapeRange(const QuadTreeShapeBlock* blocks = nullptr, int firstBlock = -1, unsigned int size = 0) : _blocks(blocks), _firstBlock(firstBlock), _size(size) {}
+
+	iterator begin() const { return iterator(_blocks, _firstBlock, _size); }
+	iterator end() const { return iterator(_blocks, -1, 0); }
+	unsigned int size() const { return _size; }
+	bool empty() const { return _size == 0; }
+
+private:
+
+	const QuadTreeShapeBlock* _blocks;
+	int _firstBlock;
+	unsigned int _size;
+};
+
 class QuadTreeManager
 {
 public:
@@ -32,18 +98,26 @@ public:
 
 	static void DumpData();
 
-	static const std::vector<InteractiveShape*>& GetNearbyShapes(InteractiveShape* shape);
+	static ShapeRange GetNearbyShapes(InteractiveShape* shape);
+
+	static void GetStats(TreeStats& stats);
+
+	static void ResetStats();
 
 private:
 
-	static void AddShape(InteractiveShape* shape, int startingNode);
+	static void AddShape(ShapeHandle handle, int startingNode);
 
-	static int CheckShapeNodeCollide(InteractiveShape* shape, QuadTreeNode* node);
+	static int CheckShapeNodeCollide(ShapeHandle handle, QuadTreeNode* node);
 
 	static void InitChildren(int nodeIndex);
 
 	static QuadTreeNode* InitNode(int depth, int parentIndex, int childNum, float left, float right, float top, float bottom);
 
+	static void PushShape(QuadTreeNode* node, ShapeHandle handle);
+
+	static ShapeRange GetShapes(QuadTreeNode* node);
+
 	static void ActivateChildren(QuadTreeNode* parent);
 
 	static void DeactivateNode(QuadTreeNode* node);
@@ -53,7 +127,14 @@ private:
 	static int GetDepthIndex(int depth);
 
 	static std::vector<QuadTreeNode*> _quadTree;
-	static std::vector<InteractiveShape*> _shapes;
+	static std::vector<ShapeHandle> _shapes;
+	static NodePool<QuadTreeNode> _nodePool;
+	// Holds the shape blocks of every node. The buffer is only ever added to, and the blocks in it are handed out again from the
+	// start each update, so once it has grown to fit the busiest frame an update allocates nothing.
+	static std::vector<QuadTreeShapeBlock> _shapeBlocks;
+	static unsigned int _usedBlocks;
+	// The running counts for the stats. The rest of the stats are worked out from the nodes when they're asked for.
+	static TreeStats _stats;
 	static unsigned int _maxDepth;
 	static unsigned int _maxPerNode;
 	static RenderShape _outlineTemplate;
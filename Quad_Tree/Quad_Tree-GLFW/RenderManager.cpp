@@ -4,13 +4,24 @@
 #include "Init_Shader.h"
 #include "InputManager.h"
 #include "QuadTreeManager.h"
+#include "ShapeStore.h"
+#include "JobManager.h"
+#include "Profiler.h"
 #include <GLM\gtc\random.hpp>
+#include <algorithm>
+
+// How many shapes each thread updates at a time
+static const int UPDATE_CHUNK_SIZE = 256;
 
 std::vector<RenderShape*> RenderManager::_shapes = std::vector<RenderShape*>();
 std::vector<InteractiveShape*> RenderManager::_interactiveShapes = std::vector<InteractiveShape*>();
 
 glm::mat4 RenderManager::_projMat = glm::ortho(-1.337f, 1.337f, -1.0f, 1.0f);
 
+NodePool<RenderManager::MousedIndex> RenderManager::_mousedIndexPool;
+std::vector<RenderManager::MousedIndex*> RenderManager::_mousedIndices = std::vector<RenderManager::MousedIndex*>();
+std::vector<DrawCall> RenderManager::_drawCalls = std::vector<DrawCall>();
+
 void RenderManager::GenerateShapes(Shader shader, GLuint vao, int numShapes, GLenum type, GLsizei count)
 {
 	Collider collider;
@@ -30,6 +41,10 @@ void RenderManager::AddShape(Shader shader, GLuint vao, GLenum type, GLsizei cou
 {
 	_interactiveShapes.push_back(new InteractiveShape(collider, vao, count, type, shader, color));
 	_interactiveShapes[_interactiveShapes.size() - 1]->transform() = transform;
+	// The shape store moves interactive shapes, so the transform's position and velocity are handed over to it
+	_interactiveShapes[_interactiveShapes.size() - 1]->SetPosition(glm::vec2(transform.position.x, transform.position.y));
+	_interactiveShapes[_interactiveShapes.size() - 1]->SetVelocity(glm::vec2(transform.linearVelocity.x, transform.linearVelocity.y));
+	_interactiveShapes[_interactiveShapes.size() - 1]->transform().linearVelocity = glm::vec3();
 }
 
 void RenderManager::AddShape(Shader shader, GLuint vao, GLenum type, GLsizei count, glm::vec4 color, Transform transform)
@@ -44,45 +59,91 @@ void RenderManager::AddShape(RenderShape* shape)
 	_shapes[_shapes.size() - 1]->transform() = shape->transform();
 }
 
+// Shapes are updated in chunks spread across the job manager's threads. A shape's update only touches the shape itself and its
+// own slot in the shape store, so the threads never share anything while they work. Each thread notes which of its shapes has
+// the mouse, and the quad-tree is only asked for the shapes near it once every thread is done.
 void RenderManager::Update(float dt)
 {
-	std::vector<InteractiveShape*>& moused = std::vector<InteractiveShape*>();
-	unsigned int numShapes = _shapes.size();
-	for (unsigned int i = 0; i < numShapes; ++i)
+	ProfileZone zone("RenderManager::Update");
+	JobManager::ParallelFor((int)_shapes.size(), UPDATE_CHUNK_SIZE, [dt](int begin, int end, unsigned int /*thread*/)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			_shapes[i]->Update(dt);
+		}
+	});
+	unsigned int numShapes = _interactiveShapes.size();
+	if (!InputManager::spaceKey(false) && InputManager::spaceKey(true))
 	{
-		_shapes[i]->Update(dt);
+		for (unsigned int i = 0; i < numShapes; ++i)
+		{
+			_interactiveShapes[i]->SetVelocity(_interactiveShapes[i]->velocity().x == 0.0f ? glm::vec2(glm::linearRand(-0.5f, 0.5f), glm::linearRand(-0.5f, 0.5f)) : glm::vec2());
+		}
 	}
-	numShapes = _interactiveShapes.size();
-	for (unsigned int i = 0; i < numShapes; ++i)
+	// Every interactive shape is moved in one pass over the shape store before the shapes themselves catch up with it
+	ShapeStore::Integrate(dt);
+	static_assert(sizeof(MousedIndex) == CACHE_LINE_SIZE, "Each thread's index has to fill exactly one cache line");
+	if (_mousedIndices.size() < JobManager::numThreads())
 	{
-		if (!InputManager::spaceKey(false) && InputManager::spaceKey(true))
+		_mousedIndexPool.Init(JobManager::numThreads());
+		_mousedIndices.clear();
+		for (unsigned int i = 0; i < JobManager::numThreads(); ++i)
 		{
-			_interactiveShapes[i]->transform().linearVelocity = _interactiveShapes[i]->transform().linearVelocity.x == 0.0f ? glm::vec3(glm::linearRand(-0.5f, 0.5f), glm::linearRand(-0.5f, 0.5f), 0.0f) : glm::vec3();
+			_mousedIndices.push_back(_mousedIndexPool.Create());
 		}
-		_interactiveShapes[i]->Update(dt);
-		if (_interactiveShapes[i]->mouseOver())
+	}
+	unsigned int numThreads = _mousedIndices.size();
+	for (unsigned int i = 0; i < numThreads; ++i)
+	{
+		_mousedIndices[i]->index = -1;
+	}
+	JobManager::ParallelFor((int)numShapes, UPDATE_CHUNK_SIZE, [dt](int begin, int end, unsigned int thread)
+	{
+		for (int i = begin; i < end; ++i)
 		{
-			moused = QuadTreeManager::GetNearbyShapes(_interactiveShapes[i]);
+			_interactiveShapes[i]->Update(dt);
+			if (_interactiveShapes[i]->mouseOver()) _mousedIndices[thread]->index = std::max(_mousedIndices[thread]->index, i);
 		}
+	});
+
+	int mousedIndex = -1;
+	for (unsigned int i = 0; i < numThreads; ++i)
+	{
+		mousedIndex = std::max(mousedIndex, _mousedIndices[i]->index);
 	}
-	unsigned int size = moused.size();
-	for (unsigned int i = 0; i < size; ++i)
+	if (mousedIndex < 0) return;
+	ShapeRange moused = QuadTreeManager::GetNearbyShapes(_interactiveShapes[mousedIndex]);
+	for (ShapeRange::iterator it = moused.begin(); it != moused.end(); ++it)
 	{
-		moused[i]->currentColor() = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+		(*it)->currentColor() = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
 	}
 }
 
-void RenderManager::Draw()
+// Works out the draw calls for every shape this frame. After this the frame can be drawn from the draw calls alone, which
+// leaves the shapes, and the quad-tree's division lines among them, free to change while it is.
+void RenderManager::PrepareDraw()
 {
+	ProfileZone zone("RenderManager::PrepareDraw");
 	unsigned int numShapes = _shapes.size();
+	unsigned int numInteractiveShapes = _interactiveShapes.size();
+	_drawCalls.resize(numShapes + numInteractiveShapes);
 	for (unsigned int i = 0; i < numShapes; ++i)
 	{
-		_shapes[i]->Draw(_projMat);
+		_shapes[i]->PrepareDraw(_projMat, _drawCalls[i]);
 	}
-	numShapes = _interactiveShapes.size();
-	for (unsigned int i = 0; i < numShapes; ++i)
+	for (unsigned int i = 0; i < numInteractiveShapes; ++i)
+	{
+		_interactiveShapes[i]->PrepareDraw(_projMat, _drawCalls[numShapes + i]);
+	}
+}
+
+void RenderManager::Draw()
+{
+	ProfileZone zone("RenderManager::Draw");
+	unsigned int numDrawCalls = _drawCalls.size();
+	for (unsigned int i = 0; i < numDrawCalls; ++i)
 	{
-		_interactiveShapes[i]->Draw(_projMat);
+		RenderShape::Draw(_drawCalls[i]);
 	}
 }
 
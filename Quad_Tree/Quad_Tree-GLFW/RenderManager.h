@@ -2,10 +2,12 @@
 #include <GLEW\GL\glew.h>
 #include <GLM\gtc\matrix_transform.hpp>
 #include <vector>
+#include "NodePool.h"
 
 struct Transform;
 struct Collider;
 struct Shader;
+struct DrawCall;
 class RenderShape;
 class InteractiveShape;
 
@@ -23,6 +25,8 @@ public:
 
 	static void Update(float dt);
 
+	static void PrepareDraw();
+
 	static void Draw();
 
 	static void DumpData();
@@ -36,4 +40,20 @@ private:
 
 	static glm::mat4 _projMat;
 
+	// Everything to be drawn this frame, in order. Once these are gathered, drawing doesn't read the shapes.
+	static std::vector<DrawCall> _drawCalls;
+
+	static const unsigned int CACHE_LINE_SIZE = 64;
+
+	// The index of the last shape each thread found with the mouse over it, or -1 for none. Threads can steal chunks from
+	// anywhere in the list, so the last shape is the one with the highest index. Each is padded out to a cache line and made in
+	// the pool, whose blocks start on a cache line, so that no two threads' indices share a line. A vector's memory isn't lined
+	// up like that.
+	struct MousedIndex
+	{
+		int index;
+		char padding[CACHE_LINE_SIZE - sizeof(int)];
+	};
+	static NodePool<MousedIndex> _mousedIndexPool;
+	static std::vector<MousedIndex*> _mousedIndices;
 };
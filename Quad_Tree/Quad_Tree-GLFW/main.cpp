@@ -37,6 +37,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *	generation and updating of this information based on the locations of the interactive shapes. Furthermore, it maintains references and updates
 *	an array of division line RenderShapes that serve to more clearly depict what the current state of the quad tree is.
 *
+*	4) JobManager
+*	- This class owns a set of worker threads and splits large batches of work, such as updating every shape, across them.
+*	It also keeps one more thread for running a single task in the background, such as the tree update of a pipelined frame.
+*
 *	RenderShape
 *	- Holds the instance data for a shape that can be rendered to the screen. This includes a transform, a vao, a shader, the drawing
 *	mode (eg triangles, lines), it's active state, and its color
@@ -45,6 +49,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *	- Inherits from RenderShape, possessing all the same properties. Additionally, it has a collider and can use it to check collisions against
 *	world boundries, other colliders, and the cursor.
 *
+*	ShapeStore
+*	- Holds the position, size, velocity and flags of every InteractiveShape in separate arrays of plain values, indexed by a handle that each
+*	shape keeps. It moves every shape along its velocity and off the walls each frame, and the quad-tree reads its arrays directly.
+*
+*	AllocTracker
+*	- Counts the heap allocations made during each stage of a frame, and in strict mode stops the program at any made once it has warmed up.
+*
+*	Profiler
+*	- Times named zones of each frame on every thread, and writes them out as a Chrome trace and a report of how long each zone takes.
+*
+*	TreeStats
+*	- Describes the shape of a tree and counts what it has done, such as rebuilds and splits, for spotting a tree that has gone wrong.
+*
+*	NodePool
+*	- Hands out the tree's nodes from a few large blocks of memory, so that they sit next to each other and can all be freed at once.
+*
 *	Init_Shader
 *	- Contains static functions for loading, compiling and linking shaders.
 *
@@ -64,9 +84,31 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "RenderManager.h"
 #include "InputManager.h"
 #include "QuadTreeManager.h"
+#include "JobManager.h"
+#include "ShapeStore.h"
+#include "AllocTracker.h"
+#include "Profiler.h"
 
 GLFWwindow* window;
 
+// While frames are pipelined, the quad-tree for the next frame is updated on the job manager's background thread while the current
+// frame is drawn. Drawing only reads the draw calls gathered beforehand, so the two never touch the same data, and the update is
+// waited on at the start of the next frame before anything reads the tree again.
+bool pipelineFrames = true;
+
+// With strict allocations on, any heap allocation made during a frame once the program has warmed up stops it with a failed
+// assert. Either way the allocations made in each stage of the last frame can be looked at through the AllocTracker.
+bool strictAllocations = false;
+
+// With profiling on, each frame and the work done during it is timed on every thread. When the program closes, the timings are
+// written to trace.json, which can be opened in chrome://tracing, and a report of how long each zone took goes to the console.
+bool profileFrames = false;
+
+// With tree stats on, a line describing the shape of the tree and what it did during the frame is written to the console every
+// frame. The same stats can be asked for at any time between tree updates.
+bool dumpTreeStats = false;
+TreeStats treeStats;
+
 GLuint vertexShader;
 GLuint fragmentShader;
 GLuint shaderProgram;
@@ -174,9 +216,18 @@ void init()
 	time(&timer);
 	srand((unsigned int)timer);
 
+	ShapeStore::SetBounds(glm::vec2(-1.337f, -1.0f), glm::vec2(1.337f, 1.0f));
+
 	RenderManager::GenerateShapes(shader, vao0, 100, GL_TRIANGLES, 6);
 
 	InputManager::Init(window);
+
+	Profiler::SetEnabled(profileFrames);
+	Profiler::NameThread("Main");
+
+	JobManager::Init();
+
+	AllocTracker::SetStrict(strictAllocations);
 	
 	QuadTreeManager::InitQuadTree(-1.337f, 1.337f, 1.0f, -1.0f, 4, 2, RenderShape(vao1, 5, GL_LINE_STRIP, shader, glm::vec4(0.0f, 1.0f, 0.3f, 1.0f)));
 	unsigned int shapesSize = RenderManager::interactiveShapes().size();
@@ -188,6 +239,10 @@ void init()
 
 void step()
 {
+	ProfileZone frameZone("Frame");
+	AllocTracker::BeginFrame();
+	AllocTracker::BeginStage("Input");
+
 	// Clear to black
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -198,18 +253,55 @@ void step()
 	float dt = (float)glfwGetTime();
 	glfwSetTime(0.0f);
 
-	QuadTreeManager::UpdateQuadtree();
+	// If the last frame started an update while it was drawing, that update already brought the tree up to date for this frame
+	AllocTracker::BeginStage("Tree");
+	if (JobManager::taskPending())
+	{
+		JobManager::WaitTask();
+	}
+	else
+	{
+		QuadTreeManager::UpdateQuadtree();
+	}
 
+	AllocTracker::BeginStage("Update");
 	RenderManager::Update(dt);
 
+	AllocTracker::BeginStage("Prepare");
+	RenderManager::PrepareDraw();
+
+	// The tree isn't touched again until the next update starts, so this frame's stats are complete
+	if (dumpTreeStats)
+	{
+		QuadTreeManager::GetStats(treeStats);
+		treeStats.Write(std::cout);
+		QuadTreeManager::ResetStats();
+	}
+
+	if (pipelineFrames)
+	{
+		JobManager::StartTask(QuadTreeManager::UpdateQuadtree);
+	}
+
+	AllocTracker::BeginStage("Draw");
 	RenderManager::Draw();
 
 	// Swap buffers
 	glfwSwapBuffers(window);
+
+	AllocTracker::EndFrame();
 }
 
 void cleanUp()
 {
+	JobManager::WaitTask();
+
+	if (profileFrames)
+	{
+		if (!Profiler::WriteChromeTrace("trace.json")) std::cerr << "Could not write trace.json" << std::endl;
+		Profiler::WriteReport(std::cout);
+	}
+
 	glDeleteProgram(shaderProgram);
 	glDeleteShader(vertexShader);
 	glDeleteShader(fragmentShader);
@@ -224,6 +316,10 @@ void cleanUp()
 
 	QuadTreeManager::DumpData();
 
+	JobManager::DumpData();
+
+	ShapeStore::DumpData();
+
 	glfwTerminate();
 }
 